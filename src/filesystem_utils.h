@@ -2,6 +2,7 @@
 #define FILESYSTEM_UTILS_H
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <vector>
 #include <string>
 #include <algorithm>
@@ -134,6 +135,30 @@ static path_t get_executable_directory()
 }
 #endif // _WIN32
 
+#if _WIN32
+static path_t get_cache_directory()
+{
+    const wchar_t* localappdata = _wgetenv(L"LOCALAPPDATA");
+    if (!localappdata || !localappdata[0])
+        return get_executable_directory();
+
+    return path_t(localappdata) + L"\\realesrgan-ncnn-vulkan\\";
+}
+#else // _WIN32
+static path_t get_cache_directory()
+{
+    const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+    if (xdg_cache_home && xdg_cache_home[0])
+        return path_t(xdg_cache_home) + "/realesrgan-ncnn-vulkan/";
+
+    const char* home = getenv("HOME");
+    if (!home || !home[0])
+        return get_executable_directory();
+
+    return path_t(home) + "/.cache/realesrgan-ncnn-vulkan/";
+}
+#endif // _WIN32
+
 static bool filepath_is_readable(const path_t& path)
 {
 #if _WIN32
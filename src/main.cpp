@@ -1,11 +1,12 @@
 // realesrgan implemented with ncnn library
+#include <errno.h>
 #include <stdio.h>
 #include <algorithm>
+#include <chrono>
 #include <clocale>
 #include <filesystem>
 #include <iostream>
 #include <map>
-#include <queue>
 #include <vector>
 namespace fs = std::filesystem;
 
@@ -28,10 +29,14 @@ namespace fs = std::filesystem;
 #include <png.h>
 #include <setjmp.h>
 #include <zlib.h>
+// libjpeg-turbo for jpeg decoding and encoding
+#include <jpeglib.h>
 #endif  // _WIN32
 #include "webp_image.h"
 
 #if _WIN32
+#include <io.h>
+#include <limits.h>
 #include <wchar.h>
 static wchar_t* optarg = NULL;
 static int optind = 1;
@@ -73,6 +78,45 @@ static std::vector<int> parse_optarg_int_array(const wchar_t* optarg)
 
     return array;
 }
+
+// webp setting of the form quality[:method], quality is 0-100 for lossy, l for
+// lossless or n followed by the near lossless level, 0 on success
+static int parse_optarg_webp(const wchar_t* optarg,
+                             float* quality,
+                             int* method,
+                             int* near_lossless)
+{
+    // every field must be a number up to the next separator, "fast" is not
+    // quality 0
+    wchar_t* end = (wchar_t*)optarg;
+
+    *quality = -1;
+    *near_lossless = 100;
+    if (optarg[0] == L'l')
+        end = (wchar_t*)optarg + 1;
+    else if (optarg[0] == L'n')
+        *near_lossless = (int)wcstol(optarg + 1, &end, 10);
+    else
+        *quality = wcstof(optarg, &end);
+
+    if (end == optarg || end == optarg + (optarg[0] == L'n') ||
+        (*end != L'\0' && *end != L':'))
+        return 1;
+
+    *method = 4;
+    if (*end == L':')
+    {
+        const wchar_t* p = end + 1;
+        *method = (int)wcstol(p, &end, 10);
+        if (end == p || *end != L'\0') return 1;
+    }
+
+    // written so that a nan quality fails too
+    const int lossy = optarg[0] != L'l' && optarg[0] != L'n';
+    return (lossy && !(*quality >= 0 && *quality <= 100)) ||
+           *near_lossless < 0 || *near_lossless > 100 || *method < 0 ||
+           *method > 6;
+}
 #else                // _WIN32
 #include <unistd.h>  // getopt()
 
@@ -91,6 +135,45 @@ static std::vector<int> parse_optarg_int_array(const char* optarg)
 
     return array;
 }
+
+// webp setting of the form quality[:method], quality is 0-100 for lossy, l for
+// lossless or n followed by the near lossless level, 0 on success
+static int parse_optarg_webp(const char* optarg,
+                             float* quality,
+                             int* method,
+                             int* near_lossless)
+{
+    // every field must be a number up to the next separator, "fast" is not
+    // quality 0
+    char* end = (char*)optarg;
+
+    *quality = -1;
+    *near_lossless = 100;
+    if (optarg[0] == 'l')
+        end = (char*)optarg + 1;
+    else if (optarg[0] == 'n')
+        *near_lossless = (int)strtol(optarg + 1, &end, 10);
+    else
+        *quality = strtof(optarg, &end);
+
+    if (end == optarg || end == optarg + (optarg[0] == 'n') ||
+        (*end != '\0' && *end != ':'))
+        return 1;
+
+    *method = 4;
+    if (*end == ':')
+    {
+        const char* p = end + 1;
+        *method = (int)strtol(p, &end, 10);
+        if (end == p || *end != '\0') return 1;
+    }
+
+    // written so that a nan quality fails too
+    const int lossy = optarg[0] != 'l' && optarg[0] != 'n';
+    return (lossy && !(*quality >= 0 && *quality <= 100)) ||
+           *near_lossless < 0 || *near_lossless > 100 || *method < 0 ||
+           *method > 6;
+}
 #endif               // _WIN32
 
 // ncnn
@@ -132,93 +215,429 @@ static void print_usage()
             "  -j load:proc:save    thread count for load/proc/save "
             "(default=1:2:2) can be 1:2,2,2:2 for multi-gpu\n"
 
+            "  -q queue-depth       task queue depth between load/proc/save "
+            "(default=8)\n"
+
+            "  -p prepadding        overlap in pixels between tiles, seams "
+            "may show where the model sees further (default=10)\n"
+
+            "  -b feather           blend tile seams across this many pixels "
+            "on either side, at most prepadding (default=0)\n"
+
             "  -x                   enable tta mode\n"
 
+            "  -a                   benchmark tile sizes for tile-size 0 and "
+            "cache the fastest per device, replacing any cached entry\n"
+
             "  -f format            output image format (jpg/png/webp, "
             "default=ext/png)\n"
 
+            "  -w quality[:method]  webp quality 0-100, l for lossless or n0-n99 "
+            "for near lossless, method 0-6 (default=l:4)\n"
+#if !_WIN32
+
+            "  -c level[:filter]    png compression level 0-9 and row filter "
+            "none/sub/up/avg/paeth/adaptive (default=6:adaptive, 1 for "
+            "stdout)\n"
+
+            "  -e quality[:sub]     jpeg quality 1-100 and chroma subsampling "
+            "444/422/420 (default=100:444)\n"
+
+            "  -d scale             decode jpeg input at 1/scale in the dct "
+            "domain, 1/2/4/8 (default=1)\n"
+
+            "  -r wxh:pix_fmt       read and write raw frames of this size on "
+            "stdin and stdout instead of png, pix_fmt is rgb24 or rgba\n"
+#endif
+
             "  -v                   verbose output\n");
 }
 
 #if !_WIN32
-// fast PNG writer using libpng with no compression
-struct png_memory_writer_state
+// png writer deflating bands of rows on several threads at once, every band is
+// an independent raw deflate stream primed with the 32k of filtered rows
+// before it and ended on a byte boundary, so the bands simply concatenate into
+// the one zlib stream of the idat chunks
+
+// png_filter values beyond the five of the format
+static const int PNG_FILTER_VALUE_ADAPTIVE = 5;
+
+// output settings, fixed before any save thread runs
+static int png_compression_level = -1;
+static int png_filter = -1;
+static int png_encode_threads = 1;
+
+static inline int png_paeth(int a, int b, int c)
 {
-    unsigned char* buffer;
-    size_t size;
-    size_t capacity;
-};
+    const int p = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+// writes the filter byte and the filtered row to out, prev is 0 for row 0
+static void png_filter_row_with(int filter,
+                                const unsigned char* row,
+                                const unsigned char* prev,
+                                int rowbytes,
+                                int bpp,
+                                unsigned char* out)
+{
+    out[0] = (unsigned char)filter;
+    out++;
+
+    for (int i = 0; i < rowbytes; i++)
+    {
+        const int a = i >= bpp ? row[i - bpp] : 0;
+        const int b = prev ? prev[i] : 0;
+        const int c = prev && i >= bpp ? prev[i - bpp] : 0;
+
+        int v = row[i];
+        switch (filter)
+        {
+            case PNG_FILTER_VALUE_SUB:
+                v -= a;
+                break;
+            case PNG_FILTER_VALUE_UP:
+                v -= b;
+                break;
+            case PNG_FILTER_VALUE_AVG:
+                v -= (a + b) / 2;
+                break;
+            case PNG_FILTER_VALUE_PAETH:
+                v -= png_paeth(a, b, c);
+                break;
+        }
 
-static void png_write_to_memory(png_structp png_ptr,
-                                png_bytep data,
-                                png_size_t length)
+        out[i] = (unsigned char)v;
+    }
+}
+
+// adaptive picks the filter with the smallest sum of absolute signed bytes,
+// the heuristic libpng uses, scratch holds one filtered row
+static void png_filter_row(int filter,
+                           const unsigned char* row,
+                           const unsigned char* prev,
+                           int rowbytes,
+                           int bpp,
+                           unsigned char* out,
+                           unsigned char* scratch)
 {
-    png_memory_writer_state* state =
-        (png_memory_writer_state*)png_get_io_ptr(png_ptr);
+    if (filter != PNG_FILTER_VALUE_ADAPTIVE)
+    {
+        png_filter_row_with(filter, row, prev, rowbytes, bpp, out);
+        return;
+    }
 
-    // resize buffer if needed
-    if (state->size + length > state->capacity)
+    unsigned long best_sum = 0;
+    for (int f = PNG_FILTER_VALUE_NONE; f <= PNG_FILTER_VALUE_PAETH; f++)
     {
-        size_t new_capacity = state->capacity * 2;
-        if (new_capacity < state->size + length)
+        png_filter_row_with(f, row, prev, rowbytes, bpp, scratch);
+
+        unsigned long sum = 0;
+        for (int i = 1; i <= rowbytes; i++)
         {
-            new_capacity = state->size + length;
+            sum += abs((int)(signed char)scratch[i]);
         }
-        unsigned char* new_buffer =
-            (unsigned char*)realloc(state->buffer, new_capacity);
-        if (!new_buffer)
+
+        if (f == PNG_FILTER_VALUE_NONE || sum < best_sum)
         {
-            png_error(png_ptr, "Memory allocation failed");
+            best_sum = sum;
+            memcpy(out, scratch, rowbytes + 1);
         }
-        state->buffer = new_buffer;
-        state->capacity = new_capacity;
     }
+}
+
+class PngBandEncoder
+{
+   public:
+    const unsigned char* data;
+    int width;
+    int height;
+    int channels;
+    int band_rows;
+    int level;
+    int filter;
+    int (*wait_rows)(int rows, void* userdata);
+    void* userdata;
+
+    // compressed bytes, adler32 and length of the filtered rows of each band
+    std::vector<std::vector<unsigned char> > out;
+    std::vector<uLong> adler;
+    std::vector<size_t> raw_size;
+    std::vector<int> ok;
+
+    ncnn::Mutex lock;
+    int next_band;
+};
+
+static void png_encode_band(PngBandEncoder& e, int band)
+{
+    const int rowbytes = e.width * e.channels;
+    const size_t stride = (size_t)rowbytes + 1;
+    const int y0 = band * e.band_rows;
+    const int y1 = std::min(y0 + e.band_rows, e.height);
+    const int bands = (e.height + e.band_rows - 1) / e.band_rows;
+
+    if (e.wait_rows) e.wait_rows(y1, e.userdata);
+
+    std::vector<unsigned char> scratch(stride);
+
+    // the last 32k of filtered rows before the band, the decoder has them in
+    // its window already so the band may refer back into them
+    const int dict_rows =
+        std::min(y0, (int)((32768 + stride - 1) / stride));
+    std::vector<unsigned char> filtered((size_t)(dict_rows + y1 - y0) *
+                                        stride);
+    for (int y = y0 - dict_rows; y < y1; y++)
+    {
+        const unsigned char* row = e.data + (size_t)y * rowbytes;
+        png_filter_row(e.filter, row, y > 0 ? row - rowbytes : 0, rowbytes,
+                       e.channels,
+                       filtered.data() + (size_t)(y - y0 + dict_rows) * stride,
+                       scratch.data());
+    }
+
+    const size_t dict_size = std::min((size_t)dict_rows * stride, (size_t)32768);
+    const unsigned char* in = filtered.data() + (size_t)dict_rows * stride;
+    const size_t in_size = (size_t)(y1 - y0) * stride;
+
+    e.adler[band] = adler32(adler32(0, Z_NULL, 0), in, (uInt)in_size);
+    e.raw_size[band] = in_size;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, e.level, Z_DEFLATED, -15, 8,
+                     e.filter == PNG_FILTER_VALUE_NONE ? Z_DEFAULT_STRATEGY
+                                                       : Z_FILTERED) != Z_OK)
+        return;
+
+    if (dict_size)
+    {
+        deflateSetDictionary(&zs, in - dict_size, (uInt)dict_size);
+    }
+
+    // room for the sync flush marker on top of the bound
+    std::vector<unsigned char>& out = e.out[band];
+    out.resize(deflateBound(&zs, (uLong)in_size) + 64);
+
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = (uInt)in_size;
+    zs.next_out = out.data();
+    zs.avail_out = (uInt)out.size();
 
-    memcpy(state->buffer + state->size, data, length);
-    state->size += length;
+    const bool last = band == bands - 1;
+    const int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+
+    e.ok[band] = (last ? ret == Z_STREAM_END : ret == Z_OK) && zs.avail_in == 0;
 }
 
-static void png_flush_memory(png_structp png_ptr)
+static void* png_encode_worker(void* args)
 {
-    // no-op for memory writing
+    PngBandEncoder& e = *(PngBandEncoder*)args;
+    const int bands = (int)e.out.size();
+
+    for (;;)
+    {
+        // bands are taken top to bottom so they follow the rows as they come
+        e.lock.lock();
+        const int band = e.next_band++;
+        e.lock.unlock();
+
+        if (band >= bands) break;
+
+        png_encode_band(e, band);
+    }
+
+    return 0;
 }
 
-static unsigned char* write_png_to_mem_fast(const unsigned char* data,
-                                            int width,
-                                            int height,
-                                            int channels,
-                                            int* out_len)
+// helper threads a save thread keeps for the bands of every png it writes, so
+// they are started once instead of per frame, the calling thread encodes bands
+// too and run returns once every helper is done with the encoder
+class PngEncodePool
 {
-    png_structp png_ptr =
-        png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr) return NULL;
+   public:
+    PngEncodePool() : job(0), helpers(0), done(0), generation(0), quit(0) {}
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+    ~PngEncodePool()
     {
-        png_destroy_write_struct(&png_ptr, NULL);
-        return NULL;
+        lock.lock();
+        quit = 1;
+        lock.unlock();
+
+        condition.broadcast();
+
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
     }
 
-    if (setjmp(png_jmpbuf(png_ptr)))
+    void run(PngBandEncoder& e, int _helpers)
     {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        return NULL;
+        while ((int)threads.size() < _helpers)
+        {
+            HelperArgs* args = new HelperArgs;
+            args->pool = this;
+            args->index = (int)threads.size();
+            threads.push_back(new ncnn::Thread(helper, (void*)args));
+        }
+
+        lock.lock();
+        job = &e;
+        helpers = _helpers;
+        done = 0;
+        generation++;
+        lock.unlock();
+
+        condition.broadcast();
+
+        png_encode_worker((void*)&e);
+
+        lock.lock();
+        while (done < helpers)
+        {
+            condition.wait(lock);
+        }
+        job = 0;
+        lock.unlock();
     }
 
-    // set up memory writer
-    png_memory_writer_state state = {0};
-    state.capacity = width * height * channels + 1024;  // Initial capacity
-    state.buffer = (unsigned char*)malloc(state.capacity);
-    if (!state.buffer)
+   private:
+    struct HelperArgs
+    {
+        PngEncodePool* pool;
+        int index;
+    };
+
+    static void* helper(void* _args)
     {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        return NULL;
+        HelperArgs* args = (HelperArgs*)_args;
+        PngEncodePool* pool = args->pool;
+        const int index = args->index;
+        delete args;
+
+        int seen = 0;
+        for (;;)
+        {
+            pool->lock.lock();
+            while (pool->generation == seen && !pool->quit)
+            {
+                pool->condition.wait(pool->lock);
+            }
+            if (pool->quit)
+            {
+                pool->lock.unlock();
+                break;
+            }
+            seen = pool->generation;
+
+            // helpers beyond the count wanted for this png sit it out
+            PngBandEncoder* e = index < pool->helpers ? pool->job : 0;
+            pool->lock.unlock();
+
+            if (!e) continue;
+
+            png_encode_worker((void*)e);
+
+            pool->lock.lock();
+            pool->done++;
+            pool->lock.unlock();
+
+            pool->condition.broadcast();
+        }
+
+        return 0;
     }
 
-    png_set_write_fn(png_ptr, &state, png_write_to_memory, png_flush_memory);
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    std::vector<ncnn::Thread*> threads;
+    PngBandEncoder* job;
+    int helpers;
+    int done;
+    int generation;
+    int quit;
+};
+
+// -1 for the default, -2 for an unknown name
+static int parse_png_filter(const char* name)
+{
+    if (!name[0]) return -1;
+    if (strcmp(name, "none") == 0) return PNG_FILTER_VALUE_NONE;
+    if (strcmp(name, "sub") == 0) return PNG_FILTER_VALUE_SUB;
+    if (strcmp(name, "up") == 0) return PNG_FILTER_VALUE_UP;
+    if (strcmp(name, "avg") == 0) return PNG_FILTER_VALUE_AVG;
+    if (strcmp(name, "paeth") == 0) return PNG_FILTER_VALUE_PAETH;
+    if (strcmp(name, "adaptive") == 0) return PNG_FILTER_VALUE_ADAPTIVE;
+    return -2;
+}
+
+// the same settings for pngs written row by row through libpng
+static void png_set_output_options(png_structp png_ptr)
+{
+    static const int masks[6] = {PNG_FILTER_NONE, PNG_FILTER_SUB,
+                                 PNG_FILTER_UP,   PNG_FILTER_AVG,
+                                 PNG_FILTER_PAETH, PNG_ALL_FILTERS};
+
+    png_set_compression_level(
+        png_ptr, png_compression_level < 0 ? 6 : png_compression_level);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE,
+                   masks[png_filter < 0 ? PNG_FILTER_VALUE_ADAPTIVE
+                                        : png_filter]);
+}
+
+static void png_put_u32(unsigned char* p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+// appends a chunk whose data is head followed by data
+static unsigned char* png_put_chunk(unsigned char* p,
+                                    const char* type,
+                                    const unsigned char* head,
+                                    size_t head_size,
+                                    const unsigned char* data,
+                                    size_t size)
+{
+    png_put_u32(p, (uint32_t)(head_size + size));
+    memcpy(p + 4, type, 4);
+
+    unsigned char* q = p + 8;
+    if (head_size) memcpy(q, head, head_size);
+    q += head_size;
+    if (size) memcpy(q, data, size);
+    q += size;
+
+    png_put_u32(q, crc32(crc32(0, Z_NULL, 0), p + 4, (uInt)(q - (p + 4))));
 
-    // set PNG parameters for maximum speed (no compression)
+    return q + 4;
+}
+
+// wait_rows, when given, blocks until at least the first rows rows of data are
+// filled in and returns how many are, so rows are encoded as they arrive
+static unsigned char* write_png_to_mem(PngEncodePool& pool,
+                                       const unsigned char* data,
+                                       int width,
+                                       int height,
+                                       int channels,
+                                       int* out_len,
+                                       int (*wait_rows)(int rows,
+                                                        void* userdata) = 0,
+                                       void* userdata = 0)
+{
     int color_type;
     switch (channels)
     {
@@ -232,33 +651,110 @@ static unsigned char* write_png_to_mem_fast(const unsigned char* data,
             color_type = PNG_COLOR_TYPE_RGBA;
             break;
         default:
-            free(state.buffer);
-            png_destroy_write_struct(&png_ptr, &info_ptr);
             return NULL;
     }
 
-    png_set_IHDR(png_ptr, info_ptr, width, height, 8, color_type,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
-
-    // set compression level to 0 for maximum speed
-    png_set_compression_level(png_ptr, 0);
-    png_set_compression_strategy(png_ptr, Z_DEFAULT_STRATEGY);
+    const int level = png_compression_level < 0 ? 6 : png_compression_level;
+
+    PngBandEncoder e;
+    e.data = data;
+    e.width = width;
+    e.height = height;
+    e.channels = channels;
+    e.band_rows = std::max(1, (1 << 20) / (width * channels + 1));
+    e.level = level;
+    e.filter = png_filter >= 0 ? png_filter
+               : level == 0    ? PNG_FILTER_VALUE_NONE
+                               : PNG_FILTER_VALUE_ADAPTIVE;
+    e.wait_rows = wait_rows;
+    e.userdata = userdata;
+    e.next_band = 0;
+
+    const int bands = (height + e.band_rows - 1) / e.band_rows;
+    e.out.resize(bands);
+    e.adler.resize(bands);
+    e.raw_size.resize(bands);
+    e.ok.resize(bands, 0);
+
+    pool.run(e, std::max(std::min(png_encode_threads, bands) - 1, 0));
+
+    // signature, ihdr, zlib header, trailer idat and iend around the bands
+    size_t size = 8 + (12 + 13) + 2 + (12 + 4) + 12;
+    uLong adler = adler32(0, Z_NULL, 0);
+    for (int i = 0; i < bands; i++)
+    {
+        if (!e.ok[i]) return NULL;
 
-    png_write_info(png_ptr, info_ptr);
+        size += 12 + e.out[i].size();
+        adler = adler32_combine(adler, e.adler[i], (z_off_t)e.raw_size[i]);
+    }
 
-    // write image data
-    for (int y = 0; y < height; y++)
+    unsigned char* buffer = (unsigned char*)malloc(size);
+    if (!buffer) return NULL;
+
+    static const unsigned char signature[8] = {137, 80, 78, 71,
+                                               13,  10, 26, 10};
+    memcpy(buffer, signature, 8);
+
+    unsigned char ihdr[13];
+    png_put_u32(ihdr, width);
+    png_put_u32(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = (unsigned char)color_type;
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+
+    unsigned char* p = buffer + 8;
+    p = png_put_chunk(p, "IHDR", 0, 0, ihdr, 13);
+
+    // zlib header with the level hint, and the adler32 of all rows at the end
+    const unsigned char zlib_header[2] = {
+        0x78, (unsigned char)(level <= 1   ? 0x01
+                              : level <= 5 ? 0x5e
+                              : level == 6 ? 0x9c
+                                           : 0xda)};
+    unsigned char zlib_trailer[4];
+    png_put_u32(zlib_trailer, (uint32_t)adler);
+
+    // one idat per band with the zlib header in front of the first, and one
+    // more idat for the trailer
+    for (int i = 0; i < bands; i++)
     {
-        png_write_row(png_ptr, (png_const_bytep)(data + y * width * channels));
+        p = png_put_chunk(p, "IDAT", zlib_header, i == 0 ? 2 : 0,
+                          e.out[i].data(), e.out[i].size());
     }
+    p = png_put_chunk(p, "IDAT", 0, 0, zlib_trailer, 4);
+
+    p = png_put_chunk(p, "IEND", 0, 0, 0, 0);
+
+    *out_len = (int)(p - buffer);
+
+    return buffer;
+}
+
+// libpng decoder reading from memory
+struct png_memory_reader_state
+{
+    const unsigned char* data;
+    size_t size;
+    size_t offset;
+};
 
-    png_write_end(png_ptr, NULL);
+static void png_read_from_memory(png_structp png_ptr,
+                                 png_bytep data,
+                                 png_size_t length)
+{
+    png_memory_reader_state* state =
+        (png_memory_reader_state*)png_get_io_ptr(png_ptr);
 
-    *out_len = (int)state.size;
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+    if (state->offset + length > state->size)
+    {
+        png_error(png_ptr, "Read past end of data");
+    }
 
-    return state.buffer;
+    memcpy(data, state->data + state->offset, length);
+    state->offset += length;
 }
 #endif
 
@@ -266,270 +762,1469 @@ class Task
 {
    public:
     int id;
-    int webp;
 
     path_t inpath;
     path_t outpath;
 
+    // input size, also set for streamed tasks whose frames stay empty
+    int w;
+    int h;
+
     ncnn::Mat inimage;
     ncnn::Mat outimage;
-};
 
-// comparator for priority queue (lower id has higher priority)
-struct TaskComparator
-{
-    bool operator()(const Task& a, const Task& b)
-    {
-        return a.id > b.id;  // cigher id has lower priority
-    }
+    // the png is upscaled straight from inpath to outpath by the proc thread
+    // without ever holding the whole frame, stream_success is its result
+    int stream;
+    int stream_success;
+
+    // input rows per band and the rows each band has finished so far, bands
+    // finish their rows top to bottom but in any order among each other
+    int band_height;
+    std::vector<int> band_done;
+
+    // input rows [0, rows_ready) have their output in outimage
+    int rows_ready;
 };
 
-class TaskQueue
+// size keyed free lists of frame buffers, frames handed back by save are kept
+// here and reused by the next frame of the same size instead of being freed
+class FramePool
 {
    public:
-    TaskQueue() {}
+    FramePool() : free_count(0), limit(0) {}
 
-    void put(const Task& v)
+    // must be called before any thread touches the pool
+    void set_limit(int _limit) { limit = _limit; }
+
+    ncnn::Mat acquire(int w, int h, int c)
     {
+        ncnn::Mat m;
+
         lock.lock();
 
-        while (tasks.size() >= 8)  // FIXME hardcode queue length
+        std::map<uint64_t, std::vector<ncnn::Mat> >::iterator it =
+            free_frames.find(frame_key(w, h, c));
+        if (it != free_frames.end())
         {
-            condition.wait(lock);
+            m = it->second.back();
+            it->second.pop_back();
+            if (it->second.empty()) free_frames.erase(it);
+            free_count--;
         }
 
-        tasks.push(v);
-
         lock.unlock();
 
-        condition.signal();
+        if (m.empty())
+        {
+            m.create(w, h, (size_t)c, c);
+        }
+
+        return m;
     }
 
-    void get(Task& v)
+    void release(ncnn::Mat& m)
     {
+        ncnn::Mat evicted;
+
+        const uint64_t key = frame_key(m.w, m.h, m.elempack);
+
         lock.lock();
 
-        while (tasks.size() == 0)
+        if (free_count >= limit)
         {
-            condition.wait(lock);
+            // make room by dropping a frame of another size, frame sizes
+            // that stopped showing up should not pin memory forever
+            std::map<uint64_t, std::vector<ncnn::Mat> >::iterator it =
+                free_frames.begin();
+            while (it != free_frames.end() && it->first == key) it++;
+
+            if (it != free_frames.end())
+            {
+                evicted = it->second.back();
+                it->second.pop_back();
+                if (it->second.empty()) free_frames.erase(it);
+                free_count--;
+            }
         }
 
-        v = tasks.top();
-        tasks.pop();
+        if (free_count < limit)
+        {
+            free_frames[key].push_back(m);
+            free_count++;
+        }
 
         lock.unlock();
 
-        condition.signal();
+        m.release();
+    }
+
+   private:
+    static uint64_t frame_key(int w, int h, int c)
+    {
+        return ((uint64_t)w << 32) | ((uint64_t)h << 8) | (uint64_t)c;
     }
 
    private:
     ncnn::Mutex lock;
-    ncnn::ConditionVariable condition;
-    std::priority_queue<Task, std::vector<Task>, TaskComparator> tasks;
+    std::map<uint64_t, std::vector<ncnn::Mat> > free_frames;
+    int free_count;
+    int limit;
 };
 
-class SequentialTaskQueue
+// fixed slab of tasks addressed by slot index, the queues below only pass slot
+// indices around so a task is never copied between load, proc and save
+class TaskPool
 {
    public:
-    SequentialTaskQueue() : next_id(1) {}
+    TaskPool() {}
+
+    // must be called before any thread touches the pool
+    void set_size(int size)
+    {
+        tasks.resize(size);
+        free_slots.resize(size);
+        for (int i = 0; i < size; i++)
+        {
+            free_slots[i] = i;
+        }
+    }
 
-    void put(const Task& v)
+    int acquire()
     {
         lock.lock();
 
-        while (tasks.size() >= 8)  // FIXME hardcode queue length
+        while (free_slots.empty())
         {
             condition.wait(lock);
         }
 
-        tasks[v.id] = v;
+        const int index = free_slots.back();
+        free_slots.pop_back();
 
         lock.unlock();
 
-        condition.signal();
+        return index;
     }
 
-    void get(Task& v)
+    void release(int index)
     {
         lock.lock();
 
-        while (tasks.find(next_id) == tasks.end())
-        {
-            condition.wait(lock);
-        }
-
-        v = tasks[next_id];
-        tasks.erase(next_id);
-        next_id++;
+        free_slots.push_back(index);
 
         lock.unlock();
 
         condition.signal();
     }
 
+    Task& operator[](int index) { return tasks[index]; }
+
    private:
     ncnn::Mutex lock;
     ncnn::ConditionVariable condition;
-    std::map<int, Task> tasks;
-    int next_id;
+    std::vector<Task> tasks;
+    std::vector<int> free_slots;
 };
 
-TaskQueue toproc;
-SequentialTaskQueue tosave;
-
-static int read_bytes(unsigned char* buf, size_t n)
+// hands tasks to the proc threads of each gpu, a task is queued on the gpu
+// expected to finish it first going by the throughput measured so far, and a
+// thread running dry steals queued work from another gpu when it would finish
+// that task sooner than the gpu it is queued on
+// images taller than band_rows are queued as bands of input rows, so the tile
+// rows of one large image are spread over all gpus like separate tasks
+class ProcScheduler
 {
-    size_t got = 0;
-    while (got < n)
-    {
-        ssize_t r = fread(buf + got, 1, n - got, stdin);
-        if (r <= 0) return 0;
-        got += r;
-    }
-    return 1;
-}
-
-void read_png(unsigned char* sig_buf,
-              unsigned char* len_buf,
-              unsigned char* type_buf,
-              unsigned char*& img_buf,
-              size_t& buf_cap,
-              size_t& buf_len)
-{
-    const static unsigned char png_sig[8] = {0x89, 'P',  'N',  'G',
-                                             0x0D, 0x0A, 0x1A, 0x0A};
+   public:
+    ProcScheduler() : queued(0), depth(0), band_rows(0), finished(0) {}
 
-    // signature
-    if (!read_bytes(sig_buf, 8)) return;
-    if (memcmp(sig_buf, png_sig, 8))
+    // must be called before any thread touches the scheduler
+    void set_devices(const std::vector<int>& jobs_proc, int _depth,
+                     int _band_rows)
     {
-        fprintf(stderr, "Not PNG\n");
-        return;
-    }
+        depth = _depth;
+        band_rows = _band_rows;
 
-    // ensure buffer can hold at least signature
-    if (buf_cap < 8)
-    {
-        buf_cap = 8;
-        unsigned char* new_buf = (unsigned char*)realloc(img_buf, buf_cap);
-        if (!new_buf)
+        devices.resize(jobs_proc.size());
+        for (size_t i = 0; i < devices.size(); i++)
         {
-            fprintf(stderr, "Failed to allocate memory for PNG buffer\n");
-            return;
+            DeviceState& dev = devices[i];
+            dev.slots.resize(depth);
+            dev.y0.resize(depth);
+            dev.y1.resize(depth);
+            dev.pixels.resize(depth);
+            dev.head = 0;
+            dev.count = 0;
+            dev.queued_pixels = 0;
+            dev.running_pixels = 0;
+            dev.rate = 0;
+            dev.threads = jobs_proc[i];
+            dev.waiting = 0;
+            dev.running = 0;
         }
-        img_buf = new_buf;
     }
-    memcpy(img_buf, sig_buf, 8);
-    buf_len = 8;
 
-    // read chunks until IEND
-    for (;;)
+    void put(int slot, Task& v)
     {
-        if (!read_bytes(len_buf, 4)) return;
-        if (!read_bytes(type_buf, 4)) return;
-        // chunk length (big-endian)
-        uint32_t chunk_len = (len_buf[0] << 24) | (len_buf[1] << 16) |
-                             (len_buf[2] << 8) | len_buf[3];
+        const int w = v.w;
+        const int h = v.h;
+        const int rows =
+            !v.stream && band_rows > 0 && h > band_rows ? band_rows : h;
 
-        // validate chunk length to prevent overflow and excessive allocation
-        if (chunk_len > 0x7FFFFFFF || chunk_len > 100 * 1024 * 1024)
-        {
-            fprintf(stderr, "PNG chunk too large: %u bytes\n", chunk_len);
-            return;
-        }
+        // written before any band becomes visible
+        v.band_height = rows;
+        v.band_done.assign((h + rows - 1) / rows, 0);
+        v.rows_ready = 0;
 
-        // ensure capacity
-        size_t needed = buf_len + 4 + 4 + chunk_len + 4;
-        if (needed > buf_cap)
+        for (int y0 = 0; y0 < h; y0 += rows)
         {
-            // check for potential overflow
-            if (needed < buf_len)
-            {
-                fprintf(stderr, "PNG buffer size overflow\n");
-                return;
-            }
+            const int y1 = std::min(y0 + rows, h);
+            const double pixels = (double)w * (y1 - y0);
 
-            buf_cap = needed * 1.5;
-            unsigned char* new_buf = (unsigned char*)realloc(img_buf, buf_cap);
-            if (!new_buf)
+            lock.lock();
+
+            while (queued == depth)
             {
-                fprintf(stderr, "Failed to allocate memory for PNG chunk\n");
-                return;
+                not_full.wait(lock);
             }
-            img_buf = new_buf;
-        }
-        // copy length+type
-        memcpy(img_buf + buf_len, len_buf, 4);
-        buf_len += 4;
-        memcpy(img_buf + buf_len, type_buf, 4);
-        buf_len += 4;
 
-        // copy data
-        if (!read_bytes(img_buf + buf_len, chunk_len)) return;
-        buf_len += chunk_len;
-        // copy CRC
-        if (!read_bytes(img_buf + buf_len, 4)) return;
-        buf_len += 4;
+            DeviceState& dev = devices[pick_device(pixels)];
+            const int tail = (dev.head + dev.count) % depth;
+            dev.slots[tail] = slot;
+            dev.y0[tail] = y0;
+            dev.y1[tail] = y1;
+            dev.pixels[tail] = pixels;
+            dev.count++;
+            dev.queued_pixels += pixels;
+            queued++;
 
-        // check for IEND
-        if (memcmp(type_buf, "IEND", 4) == 0)
-        {
-            break;
+            lock.unlock();
+
+            condition.broadcast();
         }
     }
-}
 
-class LoadThreadParams
-{
-   public:
-    int scale;
-    int jobs_load;
-    int use_stdin;
-    int use_stdout;
+    // returns the slot whose input rows [y0, y1) are to be processed next, or
+    // -233 once finish() was called and nothing is left to run
+    int get(int device, int& y0, int& y1)
+    {
+        lock.lock();
 
-    // session data
-    std::vector<path_t> input_files;
-    std::vector<path_t> output_files;
-};
+        DeviceState& dev = devices[device];
+        dev.waiting++;
 
-void* load(void* args)
-{
-    const LoadThreadParams* ltp = (const LoadThreadParams*)args;
-    const int scale = ltp->scale;
+        int slot = -233;
+        double pixels = 0;
+        for (;;)
+        {
+            int victim = dev.count > 0 ? device : pick_victim(device);
+            if (victim != -1)
+            {
+                DeviceState& from = devices[victim];
+                slot = from.slots[from.head];
+                y0 = from.y0[from.head];
+                y1 = from.y1[from.head];
+                pixels = from.pixels[from.head];
+                from.head = (from.head + 1) % depth;
+                from.count--;
+                from.queued_pixels -= pixels;
+                queued--;
+                break;
+            }
 
-    int count;
-    if (ltp->use_stdin)
-        count = 1;
-    else
-        count = ltp->input_files.size();
+            if (finished && queued == 0) break;
 
-    unsigned char sig_buf[8];
-    unsigned char len_buf[4], type_buf[4];
-    unsigned char* img_buf = NULL;
-    size_t buf_cap = 0, buf_len = 0;
+            condition.wait(lock);
+        }
+
+        dev.waiting--;
+
+        if (slot != -233)
+        {
+            dev.running++;
+            dev.running_pixels += pixels;
+        }
+
+        const bool drained = finished && queued == 0;
+
+        lock.unlock();
+
+        if (slot != -233) not_full.signal();
+        if (drained) condition.broadcast();
+
+        return slot;
+    }
+
+    // feeds the time one proc thread spent on a band back into the estimates
+    void done(int device, double pixels, double seconds)
+    {
+        lock.lock();
+
+        DeviceState& dev = devices[device];
+        dev.running--;
+        dev.running_pixels -= pixels;
+
+        if (seconds > 0)
+        {
+            const double rate = pixels / seconds;
+            dev.rate = dev.rate == 0 ? rate : dev.rate * 0.8 + rate * 0.2;
+        }
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+    // all tasks have been put, let the proc threads leave once drained
+    void finish()
+    {
+        lock.lock();
+        finished = 1;
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+   private:
+    // pixels per second of one proc thread, gpus not measured yet are assumed
+    // to run at the average of the measured ones
+    double thread_rate(int device) const
+    {
+        if (devices[device].rate > 0) return devices[device].rate;
+
+        double sum = 0;
+        int measured = 0;
+        for (size_t i = 0; i < devices.size(); i++)
+        {
+            if (devices[i].rate > 0)
+            {
+                sum += devices[i].rate;
+                measured++;
+            }
+        }
+
+        return measured ? sum / measured : 1.0;
+    }
+
+    double device_rate(int device) const
+    {
+        return thread_rate(device) * devices[device].threads;
+    }
+
+    int pick_device(double pixels) const
+    {
+        int best = 0;
+        double best_time = 0;
+        for (int i = 0; i < (int)devices.size(); i++)
+        {
+            const DeviceState& dev = devices[i];
+            const double t =
+                (dev.running_pixels + dev.queued_pixels + pixels) /
+                device_rate(i);
+            if (i == 0 || t < best_time)
+            {
+                best = i;
+                best_time = t;
+            }
+        }
+
+        return best;
+    }
+
+    int pick_victim(int device) const
+    {
+        int best = -1;
+        double best_gain = 0;
+        for (int i = 0; i < (int)devices.size(); i++)
+        {
+            const DeviceState& dev = devices[i];
+            if (i == device || dev.count == 0) continue;
+
+            const double pixels = dev.pixels[dev.head];
+
+            // a gpu with no thread waiting or running is not about to come
+            // back for its queue, always take over then
+            const bool stuck = dev.waiting == 0 && dev.running == 0;
+
+            const double stay_time = dev.running_pixels / device_rate(i) +
+                                     pixels / thread_rate(i);
+            const double steal_time = pixels / thread_rate(device);
+            const double gain = stay_time - steal_time;
+
+            if ((stuck || gain > 0) && (best == -1 || gain > best_gain))
+            {
+                best = i;
+                best_gain = gain;
+            }
+        }
+
+        return best;
+    }
+
+   private:
+    class DeviceState
+    {
+       public:
+        std::vector<int> slots;
+        std::vector<int> y0;
+        std::vector<int> y1;
+        std::vector<double> pixels;
+        int head;
+        int count;
+        double queued_pixels;
+        double running_pixels;
+        double rate;
+        int threads;
+        int waiting;
+        int running;
+    };
+
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    ncnn::ConditionVariable not_full;
+    std::vector<DeviceState> devices;
+    int queued;
+    int depth;
+    int band_rows;
+    int finished;
+};
+
+// bounded reorder ring of slot indices, task id selects the ring entry so tasks
+// finishing out of order wait in place and get hands them out strictly by
+// increasing id
+class SequentialTaskQueue
+{
+   public:
+    SequentialTaskQueue() : next_id(1), put_waiting(0), finished(0) {}
+
+    // must be called before any thread touches the queue
+    void set_depth(int depth) { slots.resize(depth, -1); }
+
+    void put(int id, int index)
+    {
+        lock.lock();
+
+        // the entry is only free once every task depth ids before it is taken
+        while (id >= next_id + (int)slots.size())
+        {
+            put_waiting++;
+            not_full.wait(lock);
+            put_waiting--;
+        }
+
+        slots[id % slots.size()] = index;
+
+        const bool wake = id == next_id;
+
+        lock.unlock();
+
+        if (wake) not_empty.signal();
+    }
+
+    // returns -233 once finish() was called and everything was taken
+    int get()
+    {
+        lock.lock();
+
+        while (slots[next_id % slots.size()] == -1 && !finished)
+        {
+            not_empty.wait(lock);
+        }
+
+        const int entry = next_id % slots.size();
+        const int index = slots[entry];
+        if (index == -1)
+        {
+            lock.unlock();
+
+            return -233;
+        }
+
+        slots[entry] = -1;
+        next_id++;
+
+        // pass the baton if the next task already arrived
+        const bool wake = slots[next_id % slots.size()] != -1;
+        const bool wake_put = put_waiting > 0;
+
+        lock.unlock();
+
+        if (wake) not_empty.signal();
+        if (wake_put) not_full.broadcast();
+
+        return index;
+    }
+
+    // all tasks have been put, wake the getters so they can leave
+    void finish()
+    {
+        lock.lock();
+        finished = 1;
+        lock.unlock();
+
+        not_empty.broadcast();
+    }
+
+   private:
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable not_empty;
+    ncnn::ConditionVariable not_full;
+    std::vector<int> slots;
+    int next_id;
+    int put_waiting;
+    int finished;
+};
+
+FramePool framepool;
+TaskPool taskpool;
+ProcScheduler toproc;
+SequentialTaskQueue tosave;
+
+// tasks go to the save threads before they are processed, the output rows are
+// published here as the tile rows of each band come back from the gpu
+class RowTracker
+{
+   public:
+    // input rows [y0, y1) of one band have been written to outimage
+    void advance(Task& v, int y0, int y1)
+    {
+        lock.lock();
+
+        const int band = y0 / v.band_height;
+        v.band_done[band] = y1 - band * v.band_height;
+
+        const int h = v.h;
+        while (v.rows_ready < h)
+        {
+            const int b = v.rows_ready / v.band_height;
+            const int end = b * v.band_height + v.band_done[b];
+            if (end == v.rows_ready) break;
+
+            v.rows_ready = end;
+        }
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+    // blocks until at least the first rows input rows are ready, returns the
+    // number of ready input rows
+    int wait(const Task& v, int rows)
+    {
+        lock.lock();
+
+        while (v.rows_ready < rows)
+        {
+            condition.wait(lock);
+        }
+
+        const int ready = v.rows_ready;
+
+        lock.unlock();
+
+        return ready;
+    }
+
+   private:
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+};
+
+RowTracker rowtracker;
+
+// frame layout of rawvideo on stdin and stdout, rawvideo_c is 0 for png
+// frames
+static int rawvideo_w = 0;
+static int rawvideo_h = 0;
+static int rawvideo_c = 0;
+
+// stdin reads ask for at least this many bytes, into a buffer of at least
+// stdin_buffer_size
+static const size_t stdin_min_read = 64 * 1024;
+static const size_t stdin_buffer_size = 4 * 1024 * 1024;
+
+// splits the png or rawvideo stream on stdin into frames without copying them,
+// stdin is read in large blocks into one buffer and each frame is handed out as a slice
+// of it that stays valid until it is released
+class StdinFrameReader
+{
+   public:
+    StdinFrameReader()
+    {
+        buffer = 0;
+        capacity = 0;
+        begin = 0;
+        end = 0;
+        parsed = 0;
+        frame_size = 0;
+        max_frame_size = 0;
+        slice_count = 1;
+        raw_frame_size = 0;
+        eof = 0;
+    }
+
+    ~StdinFrameReader() { free(buffer); }
+
+    // frames decoded at the same time, the buffer grows until that many
+    // frames and the one being read fit in
+    void set_slices(int n) { slice_count = n; }
+
+    // frames of rawvideo are cut at this size instead of at png chunks
+    void set_frame_size(size_t size) { raw_frame_size = size; }
+
+    // returns 0 at the end of the stream or when it is no png stream
+    int next(const unsigned char*& data, size_t& length)
+    {
+        lock.lock();
+
+        for (;;)
+        {
+            const int ret = split();
+            if (ret < 0)
+            {
+                lock.unlock();
+
+                return 0;
+            }
+
+            if (ret > 0) break;
+
+            if (eof)
+            {
+                lock.unlock();
+
+                return 0;
+            }
+
+            size_t limit = write_limit();
+            if (limit - end < stdin_min_read)
+            {
+                make_room();
+                limit = write_limit();
+            }
+
+            if (limit == end)
+            {
+                // every byte is held by frames still being decoded
+                condition.wait(lock);
+                continue;
+            }
+
+            // releases only ever free space, so read without the lock
+            lock.unlock();
+
+#if _WIN32
+            const int r = _read(_fileno(stdin), buffer + end,
+                                (unsigned int)std::min(limit - end,
+                                                       (size_t)INT_MAX));
+#else
+            const ssize_t r = read(STDIN_FILENO, buffer + end, limit - end);
+#endif
+
+            lock.lock();
+
+            if (r < 0 && errno == EINTR) continue;
+
+            if (r <= 0)
+                eof = 1;
+            else
+                end += r;
+        }
+
+        data = buffer + begin;
+        length = frame_size;
+
+        slices.push_back(begin);
+
+        begin += frame_size;
+        parsed = 0;
+        max_frame_size = std::max(max_frame_size, frame_size);
+        frame_size = 0;
+
+        lock.unlock();
+
+        return 1;
+    }
+
+    // hands a slice from next() back
+    void release(const unsigned char* data)
+    {
+        lock.lock();
+
+        slices.erase(
+            std::find(slices.begin(), slices.end(), (size_t)(data - buffer)));
+
+        lock.unlock();
+
+        condition.signal();
+    }
+
+   private:
+    // walks the chunks of the frame at begin, returns 1 once it is complete,
+    // 0 while it needs more data and -1 for a broken stream
+    int split()
+    {
+        const static unsigned char png_sig[8] = {0x89, 'P',  'N',  'G',
+                                                 0x0D, 0x0A, 0x1A, 0x0A};
+
+        if (raw_frame_size) frame_size = raw_frame_size;
+
+        if (frame_size) return begin + frame_size <= end;
+
+        if (parsed == 0)
+        {
+            if (end - begin < 8) return 0;
+
+            if (memcmp(buffer + begin, png_sig, 8))
+            {
+                fprintf(stderr, "Not PNG\n");
+                return -1;
+            }
+
+            parsed = 8;
+        }
+
+        while (end - begin >= parsed + 8)
+        {
+            const unsigned char* chunk = buffer + begin + parsed;
+
+            // chunk length (big-endian)
+            uint32_t chunk_len = (chunk[0] << 24) | (chunk[1] << 16) |
+                                 (chunk[2] << 8) | chunk[3];
+
+            // validate chunk length to prevent overflow and excessive
+            // allocation
+            if (chunk_len > 0x7FFFFFFF || chunk_len > 100 * 1024 * 1024)
+            {
+                fprintf(stderr, "PNG chunk too large: %u bytes\n", chunk_len);
+                return -1;
+            }
+
+            // length, type, data and CRC
+            parsed += 4 + 4 + chunk_len + 4;
+
+            // check for IEND
+            if (memcmp(chunk + 4, "IEND", 4) == 0)
+            {
+                frame_size = parsed;
+                return begin + frame_size <= end;
+            }
+        }
+
+        return 0;
+    }
+
+    // the frame being read may grow up to the first slice behind it
+    size_t write_limit() const
+    {
+        size_t limit = capacity;
+        for (size_t i = 0; i < slices.size(); i++)
+        {
+            if (slices[i] >= end) limit = std::min(limit, slices[i]);
+        }
+
+        return limit;
+    }
+
+    // moves the frame being read to the front of the buffer when the slices
+    // leave room there, and grows the buffer once no slice holds it
+    void make_room()
+    {
+        const size_t partial = end - begin;
+        const size_t needed = std::max(partial + stdin_min_read, frame_size);
+
+        size_t front = capacity;
+        for (size_t i = 0; i < slices.size(); i++)
+        {
+            front = std::min(front, slices[i]);
+        }
+
+        if (!slices.empty())
+        {
+            if (begin > 0 && front >= needed)
+            {
+                memmove(buffer, buffer + begin, partial);
+                begin = 0;
+                end = partial;
+            }
+
+            return;
+        }
+
+        const size_t target =
+            std::max(std::max(needed, stdin_buffer_size),
+                     max_frame_size * (slice_count + 1));
+        if (capacity < target)
+        {
+            // nothing points into the buffer, it may move
+            unsigned char* new_buf = (unsigned char*)malloc(target);
+            if (!new_buf)
+            {
+                fprintf(stderr, "Failed to allocate memory for PNG buffer\n");
+                eof = 1;
+                return;
+            }
+
+            memcpy(new_buf, buffer + begin, partial);
+            free(buffer);
+
+            buffer = new_buf;
+            capacity = target;
+        }
+        else
+        {
+            memmove(buffer, buffer + begin, partial);
+        }
+
+        begin = 0;
+        end = partial;
+    }
+
+   private:
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    unsigned char* buffer;
+    size_t capacity;
+    // the frame being read sits in [begin, end), parsed bytes of it are
+    // chunks already walked and frame_size is set once IEND was seen
+    size_t begin;
+    size_t end;
+    size_t parsed;
+    size_t frame_size;
+    size_t max_frame_size;
+    // offsets of the frames handed out and not released yet
+    std::vector<size_t> slices;
+    int slice_count;
+    size_t raw_frame_size;
+    int eof;
+};
+
+StdinFrameReader stdinreader;
+
+#if !_WIN32
+// decodes png with libpng straight into a pooled frame
+// normalize to 8 bit rgb or rgba like stb_image does, returns the number of
+// interlace passes
+static int png_set_8bit_rgb(png_structp png_ptr, png_infop info_ptr)
+{
+    const int color_type = png_get_color_type(png_ptr, info_ptr);
+    const int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+    if (bit_depth == 16) png_set_strip_16(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png_ptr);
+
+    const int passes = png_set_interlace_handling(png_ptr);
+
+    png_read_update_info(png_ptr, info_ptr);
+
+    return passes;
+}
+
+static int png_load(const unsigned char* data, size_t size, ncnn::Mat& image)
+{
+    if (size < 8 || png_sig_cmp((png_const_bytep)data, 0, 8)) return 0;
+
+    png_structp png_ptr =
+        png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) return 0;
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return 0;
+    }
+
+    png_memory_reader_state state = {data, size, 0};
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+        // a frame taken before the error goes back for the next image
+        if (!image.empty()) framepool.release(image);
+        return 0;
+    }
+
+    png_set_read_fn(png_ptr, &state, png_read_from_memory);
+
+    png_read_info(png_ptr, info_ptr);
+
+    const int passes = png_set_8bit_rgb(png_ptr, info_ptr);
+
+    const int w = png_get_image_width(png_ptr, info_ptr);
+    const int h = png_get_image_height(png_ptr, info_ptr);
+    const int c = png_get_channels(png_ptr, info_ptr);
+
+    image = framepool.acquire(w, h, c);
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (int y = 0; y < h; y++)
+        {
+            png_read_row(png_ptr, (png_bytep)image.data + (size_t)y * w * c,
+                         NULL);
+        }
+    }
+
+    png_read_end(png_ptr, NULL);
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    return 1;
+}
+
+// jpeg settings, fixed before any load or save thread runs
+static int jpeg_quality = 100;
+static int jpeg_subsampling = 444;
+static int jpeg_decode_scale = 1;
+
+struct jpeg_error_state
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jmpbuf;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((jpeg_error_state*)cinfo->err)->jmpbuf, 1);
+}
+
+// decodes a jpeg in memory straight into a pooled rgb frame, scaled down by
+// jpeg_decode_scale in the dct domain
+static int jpeg_load(const unsigned char* data, size_t size, ncnn::Mat& image)
+{
+    if (size < 3 || data[0] != 0xff || data[1] != 0xd8 || data[2] != 0xff)
+        return 0;
+
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error_state err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpeg_error_exit;
+
+    if (setjmp(err.jmpbuf))
+    {
+        jpeg_destroy_decompress(&cinfo);
+
+        // a frame taken before the error goes back for the next image
+        if (!image.empty()) framepool.release(image);
+        return 0;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)data, (unsigned long)size);
+
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = jpeg_decode_scale;
+
+    jpeg_start_decompress(&cinfo);
+
+    const int w = cinfo.output_width;
+    const int h = cinfo.output_height;
+
+    image = framepool.acquire(w, h, 3);
+
+    while ((int)cinfo.output_scanline < h)
+    {
+        JSAMPROW row = (JSAMPROW)image.data + (size_t)cinfo.output_scanline * w * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return 1;
+}
+
+// the scanline loop of jpeg_save, split out so that the row buffer modified
+// after setjmp belongs to the caller, wait_rows as for the png writer
+static int jpeg_save_rows(struct jpeg_compress_struct& cinfo,
+                          jpeg_error_state& err,
+                          const unsigned char* data,
+                          int w,
+                          int h,
+                          int c,
+                          std::vector<unsigned char>& rgb,
+                          int (*wait_rows)(int rows, void* userdata),
+                          void* userdata)
+{
+    if (setjmp(err.jmpbuf)) return 0;
+
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = c == 1 ? 1 : 3;
+    cinfo.in_color_space = c == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, jpeg_quality, TRUE);
+
+    if (c != 1)
+    {
+        cinfo.comp_info[0].h_samp_factor = jpeg_subsampling == 444 ? 1 : 2;
+        cinfo.comp_info[0].v_samp_factor = jpeg_subsampling == 420 ? 2 : 1;
+    }
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    int ready = 0;
+    for (int y = 0; y < h; y++)
+    {
+        if (y >= ready)
+        {
+            ready = wait_rows ? wait_rows(y + 1, userdata) : h;
+        }
+
+        const unsigned char* p = data + (size_t)y * w * c;
+
+        // jpeg has no alpha, it is dropped
+        if (c == 4)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                rgb[x * 3 + 0] = p[x * 4 + 0];
+                rgb[x * 3 + 1] = p[x * 4 + 1];
+                rgb[x * 3 + 2] = p[x * 4 + 2];
+            }
+            p = rgb.data();
+        }
+
+        JSAMPROW row = (JSAMPROW)p;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+
+    return 1;
+}
+
+static int jpeg_save(const path_t& path,
+                     int w,
+                     int h,
+                     int c,
+                     const unsigned char* data,
+                     int (*wait_rows)(int rows, void* userdata) = 0,
+                     void* userdata = 0)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) return 0;
+
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_state err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpeg_error_exit;
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+
+    std::vector<unsigned char> rgb(c == 4 ? (size_t)w * 3 : 0);
+
+    int success = jpeg_save_rows(cinfo, err, data, w, h, c, rgb, wait_rows,
+                                 userdata);
+
+    jpeg_destroy_compress(&cinfo);
+
+    success = fclose(fp) == 0 && success;
+
+    return success;
+}
+
+#endif  // _WIN32
+
+// webp decoder output, a pooled frame held by the ncnn::Mat in userdata
+static unsigned char* webp_acquire_frame(int w, int h, int c, void* userdata)
+{
+    ncnn::Mat& image = *(ncnn::Mat*)userdata;
+
+    image = framepool.acquire(w, h, c);
+
+    return (unsigned char*)image.data;
+}
+
+// decodes a webp file while it is being read, returns 0 with fp rewound for
+// anything else, a broken webp leaves image empty
+static int webp_decode_file(FILE* fp, ncnn::Mat& image)
+{
+    const int ret = webp_load_file(fp, webp_acquire_frame, &image);
+    if (ret < 0) framepool.release(image);
+
+    return ret != 0;
+}
+
+#if !_WIN32
+// decodes an image in memory, png, jpeg and webp go straight into a pooled
+// frame while the other stb_image formats are wrapped decoder buffers
+static void decode_image(const unsigned char* data,
+                         size_t length,
+                         ncnn::Mat& image)
+{
+    if (png_load(data, length, image)) return;
+    if (jpeg_load(data, length, image)) return;
+
+    const int ret = webp_load(data, length, webp_acquire_frame, &image);
+    if (ret < 0) framepool.release(image);
+    if (ret != 0) return;
+
+    // not webp, try jpg etc.
+    int w;
+    int h;
+    int c;
+    unsigned char* pixeldata =
+        stbi_load_from_memory(data, (int)length, &w, &h, &c, 0);
+    if (pixeldata)
+    {
+        // stb_image auto channel
+        if (c == 1)
+        {
+            // grayscale -> rgb
+            stbi_image_free(pixeldata);
+            pixeldata = stbi_load_from_memory(data, (int)length, &w, &h, &c, 3);
+            c = 3;
+        }
+        else if (c == 2)
+        {
+            // grayscale + alpha -> rgba
+            stbi_image_free(pixeldata);
+            pixeldata = stbi_load_from_memory(data, (int)length, &w, &h, &c, 4);
+            c = 4;
+        }
+    }
+
+    if (pixeldata)
+    {
+        image = ncnn::Mat(w, h, (void*)pixeldata, (size_t)c, c);
+    }
+}
+
+// outputs above this many bytes are not held in memory, png to png is then
+// streamed from disk in windows of tilesize rows on a single gpu
+static const uint64_t stream_output_bytes = (uint64_t)1 << 30;
+
+// reads the header of a png file and rewinds it, returns 1 for a png whose
+// rows can be read one after another, that is one without interlacing
+static int png_probe(FILE* fp, int* w, int* h)
+{
+    unsigned char header[33];
+
+    const int ok = fread(header, 1, sizeof(header), fp) == sizeof(header) &&
+                   !png_sig_cmp(header, 0, 8) &&
+                   memcmp(header + 12, "IHDR", 4) == 0;
+
+    rewind(fp);
+
+    if (!ok) return 0;
+
+    *w = (int)png_get_uint_32(header + 16);
+    *h = (int)png_get_uint_32(header + 20);
+
+    return header[28] == PNG_INTERLACE_NONE;
+}
+
+// the row loop of stream_png, split out so that the frames modified after
+// setjmp belong to the caller
+static int stream_png_rows(png_structp read_ptr,
+                           png_infop read_info,
+                           png_structp write_ptr,
+                           png_infop write_info,
+                           const RealESRGAN* realesrgan,
+                           RealESRGANContext& ctx,
+                           ncnn::Mat& window,
+                           ncnn::Mat& outband)
+{
+    if (setjmp(png_jmpbuf(read_ptr))) return 0;
+    if (setjmp(png_jmpbuf(write_ptr))) return 0;
+
+    png_read_info(read_ptr, read_info);
+
+    if (png_set_8bit_rgb(read_ptr, read_info) != 1) return 0;
+
+    const int w = png_get_image_width(read_ptr, read_info);
+    const int h = png_get_image_height(read_ptr, read_info);
+    const int c = png_get_channels(read_ptr, read_info);
+
+    const int scale = realesrgan->scale;
+    const int tilesize = realesrgan->tilesize;
+    const int prepadding = realesrgan->prepadding;
+
+    png_set_IHDR(write_ptr, write_info, w * scale, h * scale, 8,
+                 c == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+
+    png_write_info(write_ptr, write_info);
+
+    // one tile row and its halo above and below
+    const int window_rows = std::min(tilesize + prepadding * 2, h);
+    const size_t in_stride = (size_t)w * c;
+    const size_t out_stride = (size_t)w * scale * c;
+
+    window.create(w, window_rows, (size_t)c, c);
+    outband.create(w * scale, window_rows * scale, (size_t)c, c);
+
+    // input rows [wy0, wy1) are held in window
+    int wy0 = 0;
+    int wy1 = 0;
+    for (int ty0 = 0; ty0 < h; ty0 += tilesize)
+    {
+        const int ty1 = std::min(ty0 + tilesize, h);
+        const int need0 = std::max(ty0 - prepadding, 0);
+        const int need1 = std::min(ty1 + prepadding, h);
+
+        // drop the rows above the halo of this tile row
+        if (need0 > wy0)
+        {
+            memmove(window.data,
+                    (unsigned char*)window.data + (need0 - wy0) * in_stride,
+                    (wy1 - need0) * in_stride);
+            wy0 = need0;
+        }
+
+        for (; wy1 < need1; wy1++)
+        {
+            png_read_row(read_ptr,
+                         (png_bytep)window.data + (wy1 - wy0) * in_stride,
+                         NULL);
+        }
+
+        // the window is an image of its own whose edges are either the image
+        // edges or hold the full halo, process() lays its own tile grid over
+        // it, so the seams sit where they would for a window of this height
+        // rather than where a whole-frame run would put them
+        ncnn::Mat in(w, wy1 - wy0, window.data, (size_t)c, c);
+
+        realesrgan->process(in, outband, ty0 - wy0, ty1 - wy0, ctx);
+
+        for (int y = (ty0 - wy0) * scale; y < (ty1 - wy0) * scale; y++)
+        {
+            png_write_row(write_ptr,
+                          (png_const_bytep)outband.data + y * out_stride);
+        }
+    }
+
+    png_read_end(read_ptr, NULL);
+    png_write_end(write_ptr, NULL);
+
+    return 1;
+}
+
+// upscales a png too large to hold in memory, input rows are decoded into a
+// window of tilesize rows plus their prepadding halo and the output rows of
+// each window are written out before it slides on, the rows have to be written
+// in order so the whole image runs on the one gpu of the proc thread
+static int stream_png(const RealESRGAN* realesrgan,
+                      RealESRGANContext& ctx,
+                      const path_t& inpath,
+                      const path_t& outpath)
+{
+    FILE* in_fp = fopen(inpath.c_str(), "rb");
+    if (!in_fp) return 0;
+
+    FILE* out_fp = fopen(outpath.c_str(), "wb");
+    if (!out_fp)
+    {
+        fclose(in_fp);
+        return 0;
+    }
+
+    png_structp read_ptr =
+        png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop read_info = read_ptr ? png_create_info_struct(read_ptr) : NULL;
+    png_structp write_ptr =
+        png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop write_info =
+        write_ptr ? png_create_info_struct(write_ptr) : NULL;
+
+    int success = 0;
+
+    ncnn::Mat window;
+    ncnn::Mat outband;
+    if (read_info && write_info)
+    {
+        png_init_io(read_ptr, in_fp);
+        png_init_io(write_ptr, out_fp);
+        png_set_output_options(write_ptr);
+
+        success = stream_png_rows(read_ptr, read_info, write_ptr, write_info,
+                                  realesrgan, ctx, window, outband);
+    }
+
+    png_destroy_read_struct(&read_ptr, &read_info, NULL);
+    png_destroy_write_struct(&write_ptr, &write_info);
+
+    fclose(in_fp);
+    if (fclose(out_fp) != 0) success = 0;
+
+    return success;
+}
+#endif  // _WIN32
+
+static void create_parent_folder(const path_t& path)
+{
+    fs::path fs_path = fs::absolute(path);
+    std::string parent_path = fs_path.parent_path().string();
+    if (fs::exists(parent_path) != 1)
+    {
+        std::cout << "Create folder: [" << parent_path << "]." << std::endl;
+        fs::create_directories(parent_path);
+    }
+}
+
+class LoadThreadParams
+{
+   public:
+    int scale;
+    int jobs_load;
+    int use_stdin;
+    int use_stdout;
 
-    int i = 0;
-    while (i++ < count)
+    // session data
+    std::vector<path_t> input_files;
+    std::vector<path_t> output_files;
+};
+
+// load threads take the next input index from here and put their tasks into
+// toproc strictly in index order, whatever order the decodes finish in
+class LoadOrder
+{
+   public:
+    LoadOrder() : next_index(0), next_put(0), next_id(0) {}
+
+    // the caller holds input_lock while reading the input of this index
+    int take() { return next_index++; }
+
+    // slot is -1 when the input at index failed to decode
+    void put(int index, int slot)
+    {
+        lock.lock();
+
+        while (next_put != index)
+        {
+            condition.wait(lock);
+        }
+
+        if (slot != -1)
+        {
+            Task& v = taskpool[slot];
+            v.id = ++next_id;
+            toproc.put(slot, v);
+
+            // the save thread streams the rows out as they are processed
+            tosave.put(v.id, slot);
+        }
+
+        next_put++;
+
+        lock.unlock();
+
+        condition.broadcast();
+    }
+
+   public:
+    ncnn::Mutex input_lock;
+
+   private:
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    int next_index;
+    int next_put;
+    int next_id;
+};
+
+LoadOrder loadorder;
+
+void* load(void* args)
+{
+    const LoadThreadParams* ltp = (const LoadThreadParams*)args;
+    const int scale = ltp->scale;
+
+    const int count = ltp->input_files.size();
+
+    for (;;)
     {
-        int webp = 0;
+        // stdin is consumed under the lock too so frames keep their order
+        loadorder.input_lock.lock();
+
+        const int i = loadorder.take();
+
+        // a slice of the stdin buffer, valid until handed back
+        const unsigned char* frame_data = 0;
+        size_t frame_length = 0;
+
+        int eof;
+        if (ltp->use_stdin)
+            eof = !stdinreader.next(frame_data, frame_length);
+        else
+            eof = i >= count;
+
+        loadorder.input_lock.unlock();
 
-        unsigned char* pixeldata = 0;
-        int w;
-        int h;
-        int c;
+        // end of stream, no later index can have data either
+        if (eof) break;
+
+        ncnn::Mat inimage;
 
         FILE* fp = NULL;
 
         if (!ltp->use_stdin)
         {
 #if _WIN32
-            fp = _wfopen(imagepath.c_str(), L"rb");
+            fp = _wfopen(ltp->input_files[i].c_str(), L"rb");
 #else
             fp = fopen(ltp->input_files[i].c_str(), "rb");
 #endif
         }
 
-        if (fp)
+#if !_WIN32
+        // a png whose output would not fit in memory is left to the proc
+        // thread, which streams it from disk window by window, it is never
+        // split into bands and runs on one gpu only
+        int stream_w;
+        int stream_h;
+        if (fp && !ltp->use_stdout &&
+            (get_file_extension(ltp->output_files[i]) == PATHSTR("png") ||
+             get_file_extension(ltp->output_files[i]) == PATHSTR("PNG")) &&
+            png_probe(fp, &stream_w, &stream_h) &&
+            (uint64_t)stream_w * scale * stream_h * scale * 4 >
+                stream_output_bytes)
+        {
+            fclose(fp);
+
+            const int slot = taskpool.acquire();
+
+            Task& v = taskpool[slot];
+            v.inpath = ltp->input_files[i];
+            v.outpath = ltp->output_files[i];
+            v.w = stream_w;
+            v.h = stream_h;
+            v.inimage.release();
+            v.outimage.release();
+            v.stream = 1;
+            v.stream_success = 0;
+
+            create_parent_folder(v.outpath);
+
+            loadorder.put(i, slot);
+
+            continue;
+        }
+#endif  // _WIN32
+
+        // webp is decoded chunk by chunk as the file is read
+        if (fp && webp_decode_file(fp, inimage))
+        {
+            fclose(fp);
+        }
+        else if (fp)
         {
             // read whole file
             unsigned char* filedata = 0;
@@ -548,76 +2243,51 @@ void* load(void* args)
 
             if (filedata)
             {
-                pixeldata = webp_load(filedata, length, &w, &h, &c);
+#if _WIN32
+                int w;
+                int h;
+                int c;
+                unsigned char* pixeldata = wic_decode_image(
+                    ltp->input_files[i].c_str(), &w, &h, &c);
+
                 if (pixeldata)
                 {
-                    webp = 1;
+                    inimage = ncnn::Mat(w, h, (void*)pixeldata, (size_t)c, c);
                 }
-                else
-                {
-                    // not webp, try jpg png etc.
-#if _WIN32
-                    pixeldata = wic_decode_image(imagepath.c_str(), &w, &h, &c);
 #else   // _WIN32
-                    pixeldata =
-                        stbi_load_from_memory(filedata, length, &w, &h, &c, 0);
-                    if (pixeldata)
-                    {
-                        // stb_image auto channel
-                        if (c == 1)
-                        {
-                            // grayscale -> rgb
-                            stbi_image_free(pixeldata);
-                            pixeldata = stbi_load_from_memory(filedata, length,
-                                                              &w, &h, &c, 3);
-                            c = 3;
-                        }
-                        else if (c == 2)
-                        {
-                            // grayscale + alpha -> rgba
-                            stbi_image_free(pixeldata);
-                            pixeldata = stbi_load_from_memory(filedata, length,
-                                                              &w, &h, &c, 4);
-                            c = 4;
-                        }
-                    }
+                decode_image(filedata, length, inimage);
 #endif  // _WIN32
-                }
 
                 free(filedata);
             }
         }
-        // read from stdin
+        // decode frame read from stdin
         else if (ltp->use_stdin)
         {
-            read_png(sig_buf, len_buf, type_buf, img_buf, buf_cap, buf_len);
-            pixeldata = stbi_load_from_memory(img_buf, buf_len, &w, &h, &c, 0);
-            if (pixeldata)
+            if (rawvideo_c)
             {
-                // stb_image auto channel
-                if (c == 1)
-                {
-                    // grayscale -> rgb
-                    stbi_image_free(pixeldata);
-                    pixeldata =
-                        stbi_load_from_memory(img_buf, buf_len, &w, &h, &c, 3);
-                    c = 3;
-                }
-                else if (c == 2)
-                {
-                    // grayscale + alpha -> rgba
-                    stbi_image_free(pixeldata);
-                    pixeldata =
-                        stbi_load_from_memory(img_buf, buf_len, &w, &h, &c, 4);
-                    c = 4;
-                }
+                // raw frames only have to leave the shared buffer
+                inimage =
+                    framepool.acquire(rawvideo_w, rawvideo_h, rawvideo_c);
+                memcpy(inimage.data, frame_data, frame_length);
+            }
+            else
+            {
+                decode_image(frame_data, frame_length, inimage);
             }
+
+            stdinreader.release(frame_data);
         }
 
-        if (pixeldata)
+        if (!inimage.empty())
         {
-            Task v;
-            v.id = i;
+            const int w = inimage.w;
+            const int h = inimage.h;
+            const int c = inimage.elempack;
+
+            const int slot = taskpool.acquire();
+
+            Task& v = taskpool[slot];
             if (ltp->use_stdin)
                 v.inpath = PATHSTR("stdin");
             else
@@ -628,8 +2298,11 @@ void* load(void* args)
             else
                 v.outpath = ltp->output_files[i];
 
-            v.inimage = ncnn::Mat(w, h, (void*)pixeldata, (size_t)c, c);
-            v.outimage = ncnn::Mat(w * scale, h * scale, (size_t)c, c);
+            v.w = w;
+            v.h = h;
+            v.inimage = inimage;
+            v.outimage = framepool.acquire(w * scale, h * scale, c);
+            v.stream = 0;
 
             path_t ext = get_file_extension(v.outpath);
             if (c == 4 && (ext == PATHSTR("jpg") || ext == PATHSTR("JPG") ||
@@ -641,7 +2314,8 @@ void* load(void* args)
 #if _WIN32
                 fwprintf(stderr,
                          L"image %ls has alpha channel ! %ls will output %ls\n",
-                         imagepath.c_str(), imagepath.c_str(),
+                         ltp->input_files[i].c_str(),
+                         ltp->input_files[i].c_str(),
                          output_filename2.c_str());
 #else   // _WIN32
                 fprintf(stderr,
@@ -651,124 +2325,215 @@ void* load(void* args)
 #endif  // _WIN32
             }
 
-            toproc.put(v);
+            loadorder.put(i, slot);
+        }
+        else
+        {
+            loadorder.put(i, -1);
 
             if (ltp->use_stdin)
             {
-                if (img_buf)
-                {
-                    free(img_buf);
-                    img_buf = NULL;
-                }
-
-                buf_cap = 0;
-                buf_len = 0;
-                count++;
+                fprintf(stderr, "decode image from stdin failed\n");
             }
-        }
-        else
-        {
+            else
+            {
 #if _WIN32
-            fwprintf(stderr, L"decode image %ls failed\n", imagepath.c_str());
+                fwprintf(stderr, L"decode image %ls failed\n",
+                         ltp->input_files[i].c_str());
 #else   // _WIN32
-            fprintf(stderr, "decode image %s failed\n",
-                    ltp->input_files[i].c_str());
+                fprintf(stderr, "decode image %s failed\n",
+                        ltp->input_files[i].c_str());
 #endif  // _WIN32
+            }
         }
     }
 
-    if (img_buf)
-    {
-        free(img_buf);
-        img_buf = NULL;
-    }
-
     return 0;
 }
 
 class ProcThreadParams
 {
    public:
+    int device;
     const RealESRGAN* realesrgan;
 };
 
+static void rows_done(int y0, int y1, void* userdata)
+{
+    rowtracker.advance(*(Task*)userdata, y0, y1);
+}
+
 void* proc(void* args)
 {
     const ProcThreadParams* ptp = (const ProcThreadParams*)args;
     const RealESRGAN* realesrgan = ptp->realesrgan;
 
+    // vulkan state of this thread, kept for all the frames it processes
+    RealESRGANContext ctx(*realesrgan);
+
     for (;;)
     {
-        Task v;
+        int y0;
+        int y1;
+        const int slot = toproc.get(ptp->device, y0, y1);
+
+        if (slot == -233) break;
+
+        Task& v = taskpool[slot];
+
+        // the task may be saved and recycled once its last rows are done
+        const double pixels = (double)v.w * (y1 - y0);
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+
+#if !_WIN32
+        if (v.stream)
+        {
+            v.stream_success =
+                stream_png(realesrgan, ctx, v.inpath, v.outpath);
+
+            rowtracker.advance(v, y0, y1);
+        }
+        else
+#endif
+        {
+            realesrgan->process(v.inimage, v.outimage, y0, y1, ctx, rows_done,
+                                &v);
+        }
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        toproc.done(ptp->device, pixels, elapsed.count());
+    }
+
+    return 0;
+}
+
+class SaveThreadParams
+{
+   public:
+    int verbose;
+    int use_stdout;
+
+    // image format written to stdout
+    path_t format;
+
+    // webp quality below 0 for lossless, see webp_save_to_mem
+    float webp_quality;
+    int webp_method;
+    int webp_near_lossless;
+};
+
+#if !_WIN32
+// blocks until the first rows output rows of the task are ready
+static int wait_output_rows(int rows, void* userdata)
+{
+    const Task& v = *(const Task*)userdata;
+    const int scale = v.outimage.h / v.h;
+
+    return rowtracker.wait(v, (rows + scale - 1) / scale) * scale;
+}
 
-        toproc.get(v);
+// writes the output frame to stdout as it is, rows go out as soon as they are
+// back from the gpu
+static int write_rawvideo(const Task& v)
+{
+    const int h = v.outimage.h;
+    const size_t row_size = (size_t)v.outimage.w * v.outimage.elempack;
+    const unsigned char* data = (const unsigned char*)v.outimage.data;
 
-        if (v.id == -233) break;
+    int rows = 0;
+    while (rows < h)
+    {
+        const int ready = std::min(wait_output_rows(rows + 1, (void*)&v), h);
 
-        realesrgan->process(v.inimage, v.outimage);
+        const size_t size = (size_t)(ready - rows) * row_size;
+        if (fwrite(data + rows * row_size, 1, size, stdout) != size) return 0;
 
-        tosave.put(v);
+        rows = ready;
     }
 
-    return 0;
+    return fflush(stdout) == 0;
 }
-
-class SaveThreadParams
-{
-   public:
-    int verbose;
-    int use_stdout;
-};
+#endif
 
 void* save(void* args)
 {
     const SaveThreadParams* stp = (const SaveThreadParams*)args;
     const int verbose = stp->verbose;
 
+#if !_WIN32
+    PngEncodePool pngpool;
+#endif
+
     for (;;)
     {
-        Task v;
+        const int slot = tosave.get();
 
-        tosave.get(v);
+        if (slot == -233) break;
 
-        if (v.id == -233) break;
+        Task& v = taskpool[slot];
 
-        // free input pixel data
+        int success = 0;
+        path_t ext;
+
+        if (!stp->use_stdout)
         {
-            unsigned char* pixeldata = (unsigned char*)v.inimage.data;
-            if (v.webp == 1)
-            {
-                free(pixeldata);
-            }
-            else
-            {
+            ext = get_file_extension(v.outpath);
+
+            create_parent_folder(v.outpath);
+        }
+
 #if _WIN32
-                free(pixeldata);
+        const int stream_rows = 0;
 #else
-                stbi_image_free(pixeldata);
+        // the png and jpeg writers encode rows as they come back from the gpu,
+        // every other encoder needs the whole frame
+        const int stream_rows =
+            (stp->use_stdout && stp->format != PATHSTR("webp")) ||
+            ext == PATHSTR("png") || ext == PATHSTR("PNG") ||
+            ext == PATHSTR("jpg") || ext == PATHSTR("JPG") ||
+            ext == PATHSTR("jpeg") || ext == PATHSTR("JPEG");
 #endif
-            }
+        // a streamed image is queued before the proc thread has written it, its
+        // result is only known once all of its rows are done
+        if (!stream_rows || v.stream)
+        {
+            rowtracker.wait(v, v.h);
         }
 
-        int success = 0;
-        path_t ext;
-
-        if (!stp->use_stdout)
+        if (v.stream)
         {
-            ext = get_file_extension(v.outpath);
+            // already written by the proc thread
+            success = v.stream_success;
+        }
+#if !_WIN32
+        else if (stp->use_stdout && rawvideo_c)
+        {
+            success = write_rawvideo(v);
+        }
+#endif
+        else if (stp->use_stdout && stp->format == PATHSTR("webp"))
+        {
+            size_t len;
+            unsigned char* webp = webp_save_to_mem(
+                (const unsigned char*)v.outimage.data, v.outimage.w,
+                v.outimage.h, v.outimage.elempack, &len, stp->webp_quality,
+                stp->webp_method, stp->webp_near_lossless);
 
-            /* ----------- Create folder if not exists -------------------*/
-            fs::path fs_path = fs::absolute(v.outpath);
-            std::string parent_path = fs_path.parent_path().string();
-            if (fs::exists(parent_path) != 1)
+            if (webp != NULL)
             {
-                std::cout << "Create folder: [" << parent_path << "]."
-                          << std::endl;
-                fs::create_directories(parent_path);
+#if !_WIN32
+                fwrite(webp, 1, len, stdout);
+                fflush(stdout);
+#endif
+                WebPFree(webp);
+                success = 1;
             }
         }
-
-        if (stp->use_stdout)
+        else if (stp->use_stdout)
         {
             int len;
 #if _WIN32
@@ -776,10 +2541,9 @@ void* save(void* args)
                 (const unsigned char*)v.outimage.data, 0, v.outimage.w,
                 v.outimage.h, v.outimage.elempack, &len);
 #else
-            // use fast libpng implementation with no compression
-            unsigned char* png = write_png_to_mem_fast(
-                (const unsigned char*)v.outimage.data, v.outimage.w,
-                v.outimage.h, v.outimage.elempack, &len);
+            unsigned char* png = write_png_to_mem(
+                pngpool, (const unsigned char*)v.outimage.data, v.outimage.w,
+                v.outimage.h, v.outimage.elempack, &len, wait_output_rows, &v);
 #endif
 
             if (png != NULL)
@@ -802,7 +2566,9 @@ void* save(void* args)
         {
             success = webp_save(v.outpath.c_str(), v.outimage.w, v.outimage.h,
                                 v.outimage.elempack,
-                                (const unsigned char*)v.outimage.data);
+                                (const unsigned char*)v.outimage.data,
+                                stp->webp_quality, stp->webp_method,
+                                stp->webp_near_lossless);
         }
         else if (ext == PATHSTR("png") || ext == PATHSTR("PNG"))
         {
@@ -811,9 +2577,22 @@ void* save(void* args)
                 wic_encode_image(v.outpath.c_str(), v.outimage.w, v.outimage.h,
                                  v.outimage.elempack, v.outimage.data);
 #else
-            success =
-                stbi_write_png(v.outpath.c_str(), v.outimage.w, v.outimage.h,
-                               v.outimage.elempack, v.outimage.data, 0);
+            int len;
+            unsigned char* png = write_png_to_mem(
+                pngpool, (const unsigned char*)v.outimage.data, v.outimage.w,
+                v.outimage.h, v.outimage.elempack, &len, wait_output_rows, &v);
+
+            if (png != NULL)
+            {
+                FILE* fp = fopen(v.outpath.c_str(), "wb");
+                if (fp)
+                {
+                    success = fwrite(png, 1, len, fp) == (size_t)len;
+                    success = fclose(fp) == 0 && success;
+                }
+
+                free(png);
+            }
 #endif
         }
         else if (ext == PATHSTR("jpg") || ext == PATHSTR("JPG") ||
@@ -824,9 +2603,10 @@ void* save(void* args)
                                             v.outimage.h, v.outimage.elempack,
                                             v.outimage.data);
 #else
-            success =
-                stbi_write_jpg(v.outpath.c_str(), v.outimage.w, v.outimage.h,
-                               v.outimage.elempack, v.outimage.data, 100);
+            success = jpeg_save(v.outpath, v.outimage.w, v.outimage.h,
+                                v.outimage.elempack,
+                                (const unsigned char*)v.outimage.data,
+                                wait_output_rows, &v);
 #endif
         }
         if (success)
@@ -850,11 +2630,198 @@ void* save(void* args)
             fprintf(stderr, "encode image %s failed\n", v.outpath.c_str());
 #endif
         }
+
+        // an encoder that bailed out early may leave bands still running
+        rowtracker.wait(v, v.h);
+
+        // free input pixel data
+        if (v.inimage.refcount)
+        {
+            // pooled frame
+            framepool.release(v.inimage);
+        }
+        else
+        {
+            unsigned char* pixeldata = (unsigned char*)v.inimage.data;
+#if _WIN32
+            free(pixeldata);
+#else
+            stbi_image_free(pixeldata);
+#endif
+
+            v.inimage.release();
+        }
+
+        if (!v.stream)
+        {
+            framepool.release(v.outimage);
+        }
+
+        taskpool.release(slot);
     }
 
     return 0;
 }
 
+// autotuned tile sizes are kept in a small text file in the cache directory,
+// one "tilesize key" line per device, driver and model setup
+static path_t tile_profile_path()
+{
+    return get_cache_directory() + PATHSTR("tilesize.profile");
+}
+
+static void load_tile_profile(std::map<std::string, int>& profile)
+{
+#if _WIN32
+    FILE* fp = _wfopen(tile_profile_path().c_str(), L"rb");
+#else
+    FILE* fp = fopen(tile_profile_path().c_str(), "rb");
+#endif
+    if (!fp) return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp))
+    {
+        int tilesize = 0;
+        char key[1024];
+        if (sscanf(line, "%d %1023[^\r\n]", &tilesize, key) == 2 &&
+            tilesize >= 32)
+        {
+            profile[key] = tilesize;
+        }
+    }
+
+    fclose(fp);
+}
+
+static void save_tile_profile(const std::map<std::string, int>& profile)
+{
+    const path_t path = tile_profile_path();
+    const path_t tmppath = path + PATHSTR(".tmp");
+
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+
+#if _WIN32
+    FILE* fp = _wfopen(tmppath.c_str(), L"wb");
+#else
+    FILE* fp = fopen(tmppath.c_str(), "wb");
+#endif
+    if (!fp)
+    {
+        fprintf(stderr, "cannot write tile size profile\n");
+        return;
+    }
+
+    for (std::map<std::string, int>::const_iterator it = profile.begin();
+         it != profile.end(); ++it)
+    {
+        fprintf(fp, "%d %s\n", it->second, it->first.c_str());
+    }
+
+    fclose(fp);
+
+    // concurrent runs may race here, the last complete file wins
+    fs::rename(tmppath, path, ec);
+}
+
+static std::string tile_profile_key(int gpuid, const path_t& modelpath,
+                                    int scale, int tta_mode, int prepadding)
+{
+    const ncnn::GpuInfo& info = ncnn::get_gpu_info(gpuid);
+
+    // the model file path carries the -m directory, so same-named models from
+    // different directories get their own entries
+    char driver[16];
+    snprintf(driver, sizeof(driver), "%08x", info.driver_version());
+
+    std::string key = info.device_name();
+    key += "|";
+    key += driver;
+    key += "|";
+    key += fs::path(modelpath).string();
+    key += "|x" + std::to_string(scale);
+    key += "|tta" + std::to_string(tta_mode);
+    key += "|pad" + std::to_string(prepadding);
+
+    return key;
+}
+
+// runs the model over a noise image with every tile size the heap budget
+// allows and returns the one with the highest throughput
+static int autotune_tilesize(RealESRGAN* realesrgan, int tta_mode,
+                             uint32_t heap_budget, int verbose)
+{
+    static const int candidates[] = {32, 64, 100, 128, 200, 256, 400};
+
+    // large enough that every candidate pays its share of partial tiles and
+    // prepadding overhead, tta is eight times the work so it gets a quarter
+    const int w = tta_mode ? 256 : 512;
+    const int h = w;
+    const int c = 3;
+    const int scale = realesrgan->scale;
+
+    ncnn::Mat inimage(w, h, (size_t)c, c);
+    ncnn::Mat outimage(w * scale, h * scale, (size_t)c, c);
+
+    unsigned int seed = 233;
+    for (int i = 0; i < w * h * c; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        ((unsigned char*)inimage.data)[i] = seed >> 24;
+    }
+
+    int best_tilesize = 32;
+    double best_rate = 0;
+
+    for (int i = 0; i < (int)(sizeof(candidates) / sizeof(candidates[0])); i++)
+    {
+        const int tilesize = candidates[i];
+
+        // the default policy gives 200 to 1900MB, larger tiles scale with area
+        if (tilesize > 32 &&
+            (double)tilesize * tilesize * 1900 / (200 * 200) > heap_budget)
+            break;
+
+        realesrgan->tilesize = tilesize;
+
+        double rate = 0;
+        {
+            RealESRGANContext ctx(*realesrgan);
+
+            // the first tile row warms up the allocators and row buffers
+            realesrgan->process(inimage, outimage, 0, std::min(tilesize, h), ctx);
+
+            std::chrono::steady_clock::time_point t0 =
+                std::chrono::steady_clock::now();
+
+            int ret = realesrgan->process(inimage, outimage, 0, h, ctx);
+
+            std::chrono::steady_clock::time_point t1 =
+                std::chrono::steady_clock::now();
+
+            if (ret != 0) break;
+
+            rate = w * h / std::max(
+                               std::chrono::duration<double>(t1 - t0).count(),
+                               1e-6);
+        }
+
+        if (verbose)
+        {
+            fprintf(stderr, "tilesize %d %.3f Mpx/s\n", tilesize, rate / 1e6);
+        }
+
+        if (rate > best_rate)
+        {
+            best_rate = rate;
+            best_tilesize = tilesize;
+        }
+    }
+
+    return best_tilesize;
+}
+
 #if _WIN32
 int wmain(int argc, wchar_t** argv)
 #else
@@ -871,14 +2838,21 @@ int main(int argc, char** argv)
     int jobs_load = 1;
     std::vector<int> jobs_proc;
     int jobs_save = 2;
+    int queue_depth = 8;
+    int prepadding = 10;
+    int feather = 0;
     int verbose = 0;
     int tta_mode = 0;
+    int autotune = 0;
     path_t format = PATHSTR("png");
+    float webp_quality = -1;
+    int webp_method = 4;
+    int webp_near_lossless = 100;
 
 #if _WIN32
     setlocale(LC_ALL, "");
     wchar_t opt;
-    while ((opt = getopt(argc, argv, L"i:o:s:t:m:n:g:j:f:vxh")) != (wchar_t)-1)
+    while ((opt = getopt(argc, argv, L"i:o:s:t:m:n:g:j:q:p:b:f:w:avxh")) != (wchar_t)-1)
     {
         switch (opt)
         {
@@ -907,15 +2881,35 @@ int main(int argc, char** argv)
                 swscanf(optarg, L"%d:%*[^:]:%d", &jobs_load, &jobs_save);
                 jobs_proc = parse_optarg_int_array(wcschr(optarg, L':') + 1);
                 break;
+            case L'q':
+                queue_depth = _wtoi(optarg);
+                break;
+            case L'p':
+                prepadding = _wtoi(optarg);
+                break;
+            case L'b':
+                feather = _wtoi(optarg);
+                break;
             case L'f':
                 format = optarg;
                 break;
+            case L'w':
+                if (parse_optarg_webp(optarg, &webp_quality, &webp_method,
+                                      &webp_near_lossless))
+                {
+                    fprintf(stderr, "invalid webp quality argument\n");
+                    return -1;
+                }
+                break;
             case L'v':
                 verbose = 1;
                 break;
             case L'x':
                 tta_mode = 1;
                 break;
+            case L'a':
+                autotune = 1;
+                break;
             case L'h':
             default:
                 print_usage();
@@ -924,7 +2918,7 @@ int main(int argc, char** argv)
     }
 #else   // _WIN32
     int opt;
-    while ((opt = getopt(argc, argv, "i:o:s:t:m:n:g:j:f:vxh")) != -1)
+    while ((opt = getopt(argc, argv, "i:o:s:t:m:n:g:j:q:p:b:f:w:c:e:d:r:avxh")) != -1)
     {
         switch (opt)
         {
@@ -953,15 +2947,94 @@ int main(int argc, char** argv)
                 sscanf(optarg, "%d:%*[^:]:%d", &jobs_load, &jobs_save);
                 jobs_proc = parse_optarg_int_array(strchr(optarg, ':') + 1);
                 break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                break;
+            case 'p':
+                prepadding = atoi(optarg);
+                break;
+            case 'b':
+                feather = atoi(optarg);
+                break;
             case 'f':
                 format = optarg;
                 break;
+            case 'w':
+                if (parse_optarg_webp(optarg, &webp_quality, &webp_method,
+                                      &webp_near_lossless))
+                {
+                    fprintf(stderr, "invalid webp quality argument\n");
+                    return -1;
+                }
+                break;
+            case 'c':
+            {
+                // the level must be a number, "-c fast" is not level 0
+                char* end = 0;
+                png_compression_level = (int)strtol(optarg, &end, 10);
+                png_filter = *end == ':' ? parse_png_filter(end + 1) : -1;
+                if (end == optarg || (*end != '\0' && *end != ':') ||
+                    png_compression_level < 0 || png_compression_level > 9 ||
+                    png_filter == -2)
+                {
+                    fprintf(stderr, "invalid png compression argument\n");
+                    return -1;
+                }
+                break;
+            }
+            case 'e':
+                jpeg_quality = atoi(optarg);
+                jpeg_subsampling =
+                    strchr(optarg, ':') ? atoi(strchr(optarg, ':') + 1) : 444;
+                if (jpeg_quality < 1 || jpeg_quality > 100 ||
+                    (jpeg_subsampling != 444 && jpeg_subsampling != 422 &&
+                     jpeg_subsampling != 420))
+                {
+                    fprintf(stderr, "invalid jpeg quality argument\n");
+                    return -1;
+                }
+                break;
+            case 'd':
+                jpeg_decode_scale = atoi(optarg);
+                if (jpeg_decode_scale != 1 && jpeg_decode_scale != 2 &&
+                    jpeg_decode_scale != 4 && jpeg_decode_scale != 8)
+                {
+                    fprintf(stderr, "invalid jpeg decode scale argument\n");
+                    return -1;
+                }
+                break;
+            case 'r':
+            {
+                char pix_fmt[16];
+                if (sscanf(optarg, "%dx%d:%15s", &rawvideo_w, &rawvideo_h,
+                           pix_fmt) != 3 ||
+                    rawvideo_w <= 0 || rawvideo_h <= 0)
+                {
+                    fprintf(stderr, "invalid rawvideo argument\n");
+                    return -1;
+                }
+
+                if (strcmp(pix_fmt, "rgb24") == 0)
+                    rawvideo_c = 3;
+                else if (strcmp(pix_fmt, "rgba") == 0)
+                    rawvideo_c = 4;
+                else
+                {
+                    fprintf(stderr, "invalid rawvideo pixel format %s\n",
+                            pix_fmt);
+                    return -1;
+                }
+                break;
+            }
             case 'v':
                 verbose = 1;
                 break;
             case 'x':
                 tta_mode = 1;
                 break;
+            case 'a':
+                autotune = 1;
+                break;
             case 'h':
             default:
                 print_usage();
@@ -981,6 +3054,12 @@ int main(int argc, char** argv)
         stbi_write_png_compression_level = 0;
     }
 
+    if (rawvideo_c && (!inputpath.empty() || !outputpath.empty()))
+    {
+        fprintf(stderr, "rawvideo needs stdin as input and stdout as output\n");
+        return -1;
+    }
+
     if (tilesize.size() != (gpuid.empty() ? 1 : gpuid.size()) &&
         !tilesize.empty())
     {
@@ -1003,6 +3082,24 @@ int main(int argc, char** argv)
         return -1;
     }
 
+    if (queue_depth < 1)
+    {
+        fprintf(stderr, "invalid queue depth argument\n");
+        return -1;
+    }
+
+    if (prepadding < 0)
+    {
+        fprintf(stderr, "invalid prepadding argument\n");
+        return -1;
+    }
+
+    if (feather < 0 || feather > prepadding)
+    {
+        fprintf(stderr, "invalid feather argument\n");
+        return -1;
+    }
+
     if (jobs_proc.size() != (gpuid.empty() ? 1 : gpuid.size()) &&
         !jobs_proc.empty())
     {
@@ -1119,14 +3216,8 @@ int main(int argc, char** argv)
         }
     }
 
-    int prepadding = 0;
-
-    if (model.find(PATHSTR("models")) != path_t::npos ||
-        model.find(PATHSTR("models2")) != path_t::npos)
-    {
-        prepadding = 10;
-    }
-    else
+    if (model.find(PATHSTR("models")) == path_t::npos &&
+        model.find(PATHSTR("models2")) == path_t::npos)
     {
         fprintf(stderr, "unknown model dir type\n");
         return -1;
@@ -1209,9 +3300,18 @@ int main(int argc, char** argv)
     jobs_load = std::min(jobs_load, cpu_count);
     jobs_save = std::min(jobs_save, cpu_count);
 
-    if (inputpath.empty()) jobs_load = 1;
     if (outputpath.empty()) jobs_save = 1;
 
+#if !_WIN32
+    // every save thread deflates its frame on its share of the cpus, the pipe
+    // to a consumer defaults to a cheap level
+    png_encode_threads = std::max(1, cpu_count / jobs_save);
+    if (png_compression_level < 0)
+    {
+        png_compression_level = outputpath.empty() ? 1 : 6;
+    }
+#endif
+
     int gpu_count = ncnn::get_gpu_count();
     for (int i = 0; i < use_gpu_count; i++)
     {
@@ -1233,10 +3333,16 @@ int main(int argc, char** argv)
         total_jobs_proc += jobs_proc[i];
     }
 
+    // auto tile sizes prefer a profiled one, the heap budget policy below is
+    // the fallback for setups never profiled
+    std::vector<int> tilesize_auto(use_gpu_count, 0);
+
     for (int i = 0; i < use_gpu_count; i++)
     {
         if (tilesize[i] != 0) continue;
 
+        tilesize_auto[i] = 1;
+
         uint32_t heap_budget =
             ncnn::get_gpu_device(gpuid[i])->get_heap_budget();
 
@@ -1255,21 +3361,108 @@ int main(int argc, char** argv)
     }
 
     {
+        // the model files are read once for all gpus
+        RealESRGANModel realesrgan_model;
+        if (realesrgan_model.load(paramfullpath, modelfullpath) != 0)
+        {
+            ncnn::destroy_gpu_instance();
+            return -1;
+        }
+
         std::vector<RealESRGAN*> realesrgan(use_gpu_count);
 
         for (int i = 0; i < use_gpu_count; i++)
         {
             realesrgan[i] = new RealESRGAN(gpuid[i], tta_mode);
 
-            realesrgan[i]->load(paramfullpath, modelfullpath);
+            if (realesrgan[i]->load(realesrgan_model) != 0)
+            {
+                for (int j = 0; j <= i; j++)
+                {
+                    delete realesrgan[j];
+                }
+
+                ncnn::destroy_gpu_instance();
+                return -1;
+            }
 
             realesrgan[i]->scale = scale;
             realesrgan[i]->tilesize = tilesize[i];
             realesrgan[i]->prepadding = prepadding;
+            realesrgan[i]->feather = feather;
+        }
+
+        {
+            std::map<std::string, int> profile;
+            load_tile_profile(profile);
+
+            bool profile_changed = false;
+
+            for (int i = 0; i < use_gpu_count; i++)
+            {
+                if (!tilesize_auto[i]) continue;
+
+                const std::string key = tile_profile_key(
+                    gpuid[i], modelfullpath, scale, tta_mode, prepadding);
+
+                // -a always benchmarks again and replaces the cached entry
+                std::map<std::string, int>::const_iterator it =
+                    profile.find(key);
+                if (!autotune && it != profile.end())
+                {
+                    tilesize[i] = it->second;
+                }
+                else if (autotune)
+                {
+                    fprintf(stderr, "autotune tilesize on gpu %d\n", gpuid[i]);
+
+                    uint32_t heap_budget =
+                        ncnn::get_gpu_device(gpuid[i])->get_heap_budget();
+
+                    tilesize[i] = autotune_tilesize(realesrgan[i], tta_mode,
+                                                    heap_budget, verbose);
+
+                    profile[key] = tilesize[i];
+                    profile_changed = true;
+                }
+
+                if (verbose)
+                {
+                    fprintf(stderr, "gpu %d tilesize %d\n", gpuid[i],
+                            tilesize[i]);
+                }
+
+                realesrgan[i]->tilesize = tilesize[i];
+            }
+
+            if (profile_changed)
+            {
+                save_tile_profile(profile);
+            }
         }
 
         // main routine
         {
+            // with several gpus a large image is split into bands as tall as
+            // the largest tile so every gpu gets whole tile rows of it
+            int band_rows = 0;
+            if (use_gpu_count > 1)
+            {
+                band_rows = *std::max_element(tilesize.begin(), tilesize.end());
+            }
+
+            toproc.set_devices(jobs_proc, queue_depth, band_rows);
+            tosave.set_depth(queue_depth);
+
+            // enough slots for both queues full and every thread holding one
+            taskpool.set_size(queue_depth * 2 + jobs_load + total_jobs_proc +
+                              jobs_save);
+
+            // every task in flight holds an input and an output frame
+            framepool.set_limit((queue_depth * 2 + jobs_load +
+                                 total_jobs_proc + jobs_save) *
+                                2);
+
             // load image
             LoadThreadParams ltp;
             ltp.scale = scale;
@@ -1282,17 +3475,27 @@ int main(int argc, char** argv)
             else
                 ltp.use_stdin = 0;
 
+            // each load thread holds at most one stdin frame while decoding
+            stdinreader.set_slices(jobs_load);
+            stdinreader.set_frame_size((size_t)rawvideo_w * rawvideo_h *
+                                       rawvideo_c);
+
             if (outputpath.empty())
                 ltp.use_stdout = 1;
             else
                 ltp.use_stdout = 0;
 
-            ncnn::Thread load_thread(load, (void*)&ltp);
+            std::vector<ncnn::Thread*> load_threads(jobs_load);
+            for (int i = 0; i < jobs_load; i++)
+            {
+                load_threads[i] = new ncnn::Thread(load, (void*)&ltp);
+            }
 
             // realesrgan proc
             std::vector<ProcThreadParams> ptp(use_gpu_count);
             for (int i = 0; i < use_gpu_count; i++)
             {
+                ptp[i].device = i;
                 ptp[i].realesrgan = realesrgan[i];
             }
 
@@ -1316,6 +3519,10 @@ int main(int argc, char** argv)
                 stp.use_stdout = 1;
             else
                 stp.use_stdout = 0;
+            stp.format = format;
+            stp.webp_quality = webp_quality;
+            stp.webp_method = webp_method;
+            stp.webp_near_lossless = webp_near_lossless;
 
             std::vector<ncnn::Thread*> save_threads(jobs_save);
             for (int i = 0; i < jobs_save; i++)
@@ -1324,26 +3531,21 @@ int main(int argc, char** argv)
             }
 
             // end
-            load_thread.join();
-
-            Task end;
-            end.id = -233;
-
-            for (int i = 0; i < total_jobs_proc; i++)
+            for (int i = 0; i < jobs_load; i++)
             {
-                toproc.put(end);
+                load_threads[i]->join();
+                delete load_threads[i];
             }
 
+            toproc.finish();
+
             for (int i = 0; i < total_jobs_proc; i++)
             {
                 proc_threads[i]->join();
                 delete proc_threads[i];
             }
 
-            for (int i = 0; i < jobs_save; i++)
-            {
-                tosave.put(end);
-            }
+            tosave.finish();
 
             for (int i = 0; i < jobs_save; i++)
             {
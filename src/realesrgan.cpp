@@ -3,8 +3,18 @@
 #include "realesrgan.h"
 
 #include <algorithm>
+#include <string.h>
 #include <vector>
 
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 static const uint32_t realesrgan_preproc_spv_data[] = {
     #include "realesrgan_preproc.spv.hex.h"
 };
@@ -60,6 +70,11 @@ RealESRGAN::RealESRGAN(int gpuid, bool _tta_mode)
     bicubic_3x = 0;
     bicubic_4x = 0;
     tta_mode = _tta_mode;
+
+    tile_inflight = 2;
+    feather = 0;
+
+    model = 0;
 }
 
 RealESRGAN::~RealESRGAN()
@@ -70,50 +85,250 @@ RealESRGAN::~RealESRGAN()
         delete realesrgan_postproc;
     }
 
-    bicubic_2x->destroy_pipeline(net.opt);
-    delete bicubic_2x;
+    // a failed load never gets to create them
+    if (bicubic_2x)
+    {
+        bicubic_2x->destroy_pipeline(net.opt);
+        delete bicubic_2x;
+    }
 
-    bicubic_3x->destroy_pipeline(net.opt);
-    delete bicubic_3x;
+    if (bicubic_3x)
+    {
+        bicubic_3x->destroy_pipeline(net.opt);
+        delete bicubic_3x;
+    }
 
-    bicubic_4x->destroy_pipeline(net.opt);
-    delete bicubic_4x;
+    if (bicubic_4x)
+    {
+        bicubic_4x->destroy_pipeline(net.opt);
+        delete bicubic_4x;
+    }
+
+    // the net may still reference the mapped weights until it is cleared
+    net.clear();
+
+    delete model;
 }
 
+RealESRGANModel::RealESRGANModel()
+{
+    weights = 0;
+    weights_size = 0;
 #if _WIN32
-int RealESRGAN::load(const std::wstring& parampath, const std::wstring& modelpath)
-#else
-int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
+    mapping = 0;
 #endif
+}
+
+RealESRGANModel::~RealESRGANModel()
 {
 #if _WIN32
+    if (weights)
+        UnmapViewOfFile(weights);
+    if (mapping)
+        CloseHandle((HANDLE)mapping);
+#else
+    if (weights)
+        munmap(weights, weights_size);
+#endif
+}
+
+#if _WIN32
+int RealESRGANModel::load(const std::wstring& parampath, const std::wstring& modelpath)
+#else
+int RealESRGANModel::load(const std::string& parampath, const std::string& modelpath)
+#endif
+{
+    // the param text is small and parsed from a zero terminated copy
     {
+#if _WIN32
         FILE* fp = _wfopen(parampath.c_str(), L"rb");
         if (!fp)
         {
             fwprintf(stderr, L"_wfopen %ls failed\n", parampath.c_str());
+            return -1;
         }
+#else
+        FILE* fp = fopen(parampath.c_str(), "rb");
+        if (!fp)
+        {
+            fprintf(stderr, "fopen %s failed\n", parampath.c_str());
+            return -1;
+        }
+#endif
 
-        net.load_param(fp);
+        char buf[4096];
+        size_t nread;
+        while ((nread = fread(buf, 1, sizeof(buf), fp)) > 0)
+        {
+            param.append(buf, nread);
+        }
 
         fclose(fp);
     }
+
+    // the weights are mapped read only, ncnn references them in place
+    // while uploading instead of copying them per device
+#if _WIN32
     {
-        FILE* fp = _wfopen(modelpath.c_str(), L"rb");
-        if (!fp)
+        HANDLE file = CreateFileW(modelpath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
         {
-            fwprintf(stderr, L"_wfopen %ls failed\n", modelpath.c_str());
+            fwprintf(stderr, L"CreateFileW %ls failed\n", modelpath.c_str());
+            return -1;
         }
 
-        net.load_model(fp);
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size))
+        {
+            weights_size = (size_t)size.QuadPart;
+        }
 
-        fclose(fp);
+        if (weights_size)
+        {
+            mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+
+        CloseHandle(file);
+
+        if (mapping)
+        {
+            weights = MapViewOfFile((HANDLE)mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+
+        if (!weights)
+        {
+            fwprintf(stderr, L"map %ls failed\n", modelpath.c_str());
+            return -1;
+        }
+    }
+#else
+    {
+        int fd = open(modelpath.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "open %s failed\n", modelpath.c_str());
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            weights_size = (size_t)st.st_size;
+        }
+
+        if (weights_size)
+        {
+            void* p = mmap(0, weights_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                // read front to back once per device, and shared through the
+                // page cache with every other process mapping the same file
+                madvise(p, weights_size, MADV_SEQUENTIAL);
+                weights = p;
+            }
+        }
+
+        close(fd);
+
+        if (!weights)
+        {
+            fprintf(stderr, "mmap %s failed\n", modelpath.c_str());
+            return -1;
+        }
     }
+#endif
+
+    return 0;
+}
+
+#if _WIN32
+int RealESRGAN::load(const std::wstring& parampath, const std::wstring& modelpath)
 #else
-    net.load_param(parampath.c_str());
-    net.load_model(modelpath.c_str());
+int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
 #endif
+{
+    // a model loaded by path belongs to this instance alone
+    delete model;
+    model = new RealESRGANModel;
+
+    int ret = model->load(parampath, modelpath);
+    if (ret != 0)
+        return ret;
+
+    return load(*model);
+}
+
+// reads the mapped weights in place like DataReaderFromMemory, but never past
+// the end of the mapping, a truncated model file fails to load instead
+class DataReaderFromMapping : public ncnn::DataReader
+{
+public:
+    DataReaderFromMapping(const unsigned char* _mem, size_t _size)
+        : mem(_mem), remaining(_size)
+    {
+    }
+
+    virtual size_t read(void* buf, size_t size) const
+    {
+        size = std::min(size, remaining);
+        memcpy(buf, mem, size);
+
+        mem += size;
+        remaining -= size;
+        return size;
+    }
+
+    virtual size_t reference(size_t size, const void** buf) const
+    {
+        if (size > remaining)
+            return 0;
+
+        *buf = mem;
+
+        mem += size;
+        remaining -= size;
+        return size;
+    }
+
+    size_t left() const
+    {
+        return remaining;
+    }
+
+private:
+    mutable const unsigned char* mem;
+    mutable size_t remaining;
+};
 
+int RealESRGAN::load(const RealESRGANModel& model)
+{
+    if (net.load_param_mem(model.param.c_str()) != 0)
+    {
+        fprintf(stderr, "load model param failed\n");
+        return -1;
+    }
+
+    // weights are referenced straight from the mapping while they are packed
+    // and uploaded, pages are faulted in as the layers get to them
+    DataReaderFromMapping dr((const unsigned char*)model.weights, model.weights_size);
+    if (net.load_model(dr) != 0)
+    {
+        fprintf(stderr, "load model weights failed\n");
+        return -1;
+    }
+
+    // ncnn itself ignores bytes after the last weight, they are only worth a
+    // warning as the bin may not belong to the param
+    if (dr.left() != 0)
+    {
+        fprintf(stderr, "warning: model weights have %lu trailing bytes\n", (unsigned long)dr.left());
+    }
+
+    return create_pipelines();
+}
+
+int RealESRGAN::create_pipelines()
+{
     // initialize preprocess and postprocess pipeline
     {
         std::vector<ncnn::vk_specialization_type> specializations(1);
@@ -204,393 +419,762 @@ int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
     return 0;
 }
 
+// a job handed to a slot, done once the slot has completed seq jobs
+struct TileJob
+{
+    TileSlot* slot;
+    int seq;
+};
+
+// tiles and the row transfers are recorded into a small set of command buffers
+// and each slot is submitted by its own worker thread, so the host records the
+// next job while the device is still busy with the previous ones, a job only
+// goes to the device after the jobs it depends on have completed
+class TileSlot
+{
+public:
+    TileSlot(const ncnn::VulkanDevice* _vkdev)
+        : vkdev(_vkdev), cmd(_vkdev), submitted(0), completed(0), quit(0)
+    {
+        // every slot owns its allocators, intermediate blobs released after
+        // recording must not be handed out to a job still running elsewhere
+        blob_vkallocator = vkdev->acquire_blob_allocator();
+        staging_vkallocator = vkdev->acquire_staging_allocator();
+
+        thread = new ncnn::Thread(worker, (void*)this);
+    }
+
+    ~TileSlot()
+    {
+        lock.lock();
+        while (completed < submitted)
+        {
+            condition.wait(lock);
+        }
+        quit = 1;
+        lock.unlock();
+
+        condition.broadcast();
+
+        thread->join();
+        delete thread;
+
+        vkdev->reclaim_blob_allocator(blob_vkallocator);
+        vkdev->reclaim_staging_allocator(staging_vkallocator);
+    }
+
+    // the slot must be idle, the job recorded into cmd is submitted once every
+    // job in deps has completed
+    TileJob submit(const std::vector<TileJob>& _deps = std::vector<TileJob>())
+    {
+        lock.lock();
+        deps = _deps;
+        submitted++;
+        TileJob job = {this, submitted};
+        lock.unlock();
+
+        condition.broadcast();
+
+        return job;
+    }
+
+    // blocks until every job of this slot has completed
+    void wait()
+    {
+        lock.lock();
+        while (completed < submitted)
+        {
+            condition.wait(lock);
+        }
+        lock.unlock();
+    }
+
+    static void wait(const TileJob& job)
+    {
+        TileSlot* slot = job.slot;
+
+        slot->lock.lock();
+        while (slot->completed < job.seq)
+        {
+            slot->condition.wait(slot->lock);
+        }
+        slot->lock.unlock();
+    }
+
+    ncnn::Option option(const ncnn::Option& opt) const
+    {
+        ncnn::Option slot_opt = opt;
+        slot_opt.blob_vkallocator = blob_vkallocator;
+        slot_opt.workspace_vkallocator = blob_vkallocator;
+        slot_opt.staging_vkallocator = staging_vkallocator;
+
+        return slot_opt;
+    }
+
+private:
+    static void* worker(void* args)
+    {
+        TileSlot* slot = (TileSlot*)args;
+
+        for (;;)
+        {
+            slot->lock.lock();
+            while (slot->completed == slot->submitted && !slot->quit)
+            {
+                slot->condition.wait(slot->lock);
+            }
+            if (slot->quit)
+            {
+                slot->lock.unlock();
+                break;
+            }
+            std::vector<TileJob> deps;
+            deps.swap(slot->deps);
+            slot->lock.unlock();
+
+            // the jobs depended on were submitted earlier, so this never waits
+            // on itself
+            for (size_t i = 0; i < deps.size(); i++)
+            {
+                wait(deps[i]);
+            }
+
+            slot->cmd.submit_and_wait();
+            slot->cmd.reset();
+
+            slot->lock.lock();
+            slot->completed++;
+            slot->lock.unlock();
+
+            slot->condition.broadcast();
+        }
+
+        return 0;
+    }
+
+public:
+    const ncnn::VulkanDevice* vkdev;
+    ncnn::VkCompute cmd;
+    ncnn::VkAllocator* blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator;
+
+private:
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    ncnn::Thread* thread;
+    std::vector<TileJob> deps;
+    int submitted;
+    int completed;
+    int quit;
+};
+
+// picks the tile grid for a w x h region, as few tiles as tilesize allows
+// along x with the remainder spread evenly instead of left as a thin last
+// column, then rows as tall as the padded area of a square tilesize tile
+// permits, so narrow regions get fewer taller tiles, spread evenly as well
+static void plan_tiles(int w, int h, int tilesize, int prepadding, int& tile_w, int& tile_h)
+{
+    const int xtiles = std::max((w + tilesize - 1) / tilesize, 1);
+    tile_w = (w + xtiles - 1) / xtiles;
+
+    const int padded = tilesize + prepadding * 2;
+    const int max_tile_h = std::max(padded * padded / (tile_w + prepadding * 2) - prepadding * 2, tilesize);
+
+    const int ytiles = std::max((h + max_tile_h - 1) / max_tile_h, 1);
+    tile_h = (h + ytiles - 1) / ytiles;
+}
+
+RealESRGANContext::RealESRGANContext(const RealESRGAN& realesrgan)
+{
+    vkdev = realesrgan.net.vulkan_device();
+
+    blob_vkallocator = vkdev->acquire_blob_allocator();
+    staging_vkallocator = vkdev->acquire_staging_allocator();
+
+    cmd = new ncnn::VkCompute(vkdev);
+
+    for (int k = 0; k < 2; k++)
+    {
+        upload_slots[k] = 0;
+        download_slots[k] = 0;
+    }
+}
+
+RealESRGANContext::~RealESRGANContext()
+{
+    // the row buffers go back to their allocators before those are handed back
+    for (int k = 0; k < 2; k++)
+    {
+        in_gpu[k].release();
+        out_gpu[k].release();
+    }
+
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        delete slots[i];
+    }
+
+    for (int k = 0; k < 2; k++)
+    {
+        delete upload_slots[k];
+        delete download_slots[k];
+    }
+
+    delete cmd;
+
+    vkdev->reclaim_blob_allocator(blob_vkallocator);
+    vkdev->reclaim_staging_allocator(staging_vkallocator);
+}
+
 int RealESRGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
+{
+    RealESRGANContext ctx(*this);
+
+    return process(inimage, outimage, 0, inimage.h, ctx);
+}
+
+int RealESRGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1, RealESRGANContext& ctx, rows_done_callback rows_done, void* userdata) const
 {
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, y1 - y0, tilesize, prepadding, TILE_SIZE_X, TILE_SIZE_Y);
 
-    ncnn::VkAllocator* blob_vkallocator = net.vulkan_device()->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = net.vulkan_device()->acquire_staging_allocator();
+    ncnn::VkAllocator* blob_vkallocator = ctx.blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator = ctx.staging_vkallocator;
 
     ncnn::Option opt = net.opt;
     opt.blob_vkallocator = blob_vkallocator;
     opt.workspace_vkallocator = blob_vkallocator;
     opt.staging_vkallocator = staging_vkallocator;
 
-    // each tile 100x100
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+    const int ytiles = (y1 - y0 + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+    // seams between the tiles of this call are feathered in the postproc, every
+    // tile is produced feather output pixels wider towards its neighbours and
+    // blended over what the tile to the left and the tile row above left there
+    const int last_w = w - (xtiles - 1) * TILE_SIZE_X;
+    const int last_h = (y1 - y0) - (y1 - y0 - 1) / TILE_SIZE_Y * TILE_SIZE_Y;
+
+    int feather_in = std::min(feather, prepadding);
+    if (xtiles > 1) feather_in = std::min(feather_in, last_w / 2);
+    if (ytiles > 1) feather_in = std::min(feather_in, last_h / 2);
+    if (xtiles == 1 && ytiles == 1) feather_in = 0;
+
+    const int FEATHER = feather_in * scale;
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; yi++)
+    // a single tile is uploaded, processed and downloaded in one submit
+    if (xtiles == 1 && ytiles == 1)
     {
-        const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+        ncnn::VkCompute& cmd = *ctx.cmd;
 
-        int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
-        int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding, h);
+        int in_tile_y0 = std::max(y0 - prepadding, 0);
+        int in_tile_y1 = std::min(y1 + prepadding, h);
 
-        ncnn::Mat in;
-        if (opt.use_fp16_storage && opt.use_int8_storage)
-        {
-            in = ncnn::Mat(w, (in_tile_y1 - in_tile_y0), (unsigned char*)pixeldata + in_tile_y0 * w * channels, (size_t)channels, 1);
-        }
-        else
-        {
-            if (channels == 3)
-            {
-#if _WIN32
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_BGR2RGB, w, (in_tile_y1 - in_tile_y0));
-#else
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_RGB, w, (in_tile_y1 - in_tile_y0));
-#endif
-            }
-            if (channels == 4)
-            {
-#if _WIN32
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_BGRA2RGBA, w, (in_tile_y1 - in_tile_y0));
-#else
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_RGBA, w, (in_tile_y1 - in_tile_y0));
-#endif
-            }
-        }
+        // the band is uploaded as raw interleaved pixels on every path, the
+        // preproc shader unpacks and normalizes them, so the rows go straight
+        // from the decoded frame into the mapped staging buffer
+        ncnn::Mat in = ncnn::Mat(w, (in_tile_y1 - in_tile_y0), (unsigned char*)pixeldata + (size_t)in_tile_y0 * w * channels, (size_t)channels, 1);
 
-        ncnn::VkCompute cmd(net.vulkan_device());
+        cmd.record_clone(in, ctx.in_gpu[0], opt);
 
-        // upload
-        ncnn::VkMat in_gpu;
-        {
-            cmd.record_clone(in, in_gpu, opt);
+        create_out_gpu(ctx.out_gpu[0], w * scale, (y1 - y0) * scale, channels, opt);
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
-        }
+        process_tile(ctx.in_gpu[0], ctx.out_gpu[0], ctx.out_gpu[1], 0, y0, y1, w, channels, TILE_SIZE_X, xtiles, 0, 0, cmd, opt);
 
-        int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
-        int out_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h);
+        unsigned char* outdata = (unsigned char*)outimage.data + (size_t)y0 * scale * w * scale * channels;
 
-        ncnn::VkMat out_gpu;
+        ncnn::Mat out;
         if (opt.use_fp16_storage && opt.use_int8_storage)
         {
-            out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, (size_t)channels, 1, blob_vkallocator);
-        }
-        else
-        {
-            out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, channels, (size_t)4u, 1, blob_vkallocator);
+            out = ncnn::Mat(w * scale, (y1 - y0) * scale, outdata, (size_t)channels, 1);
         }
 
-        for (int xi = 0; xi < xtiles; xi++)
+        cmd.record_clone(ctx.out_gpu[0], out, opt);
+
+        cmd.submit_and_wait();
+        cmd.reset();
+
+        to_pixels(out, outdata, channels, opt);
+
+        if (rows_done)
         {
-            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+            rows_done(y0, y1, userdata);
+        }
 
-            if (tta_mode)
-            {
-                // preproc
-                ncnn::VkMat in_tile_gpu[8];
-                ncnn::VkMat in_alpha_tile_gpu;
-                {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding;
-
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-
-                    if (channels == 4)
-                    {
-                        in_alpha_tile_gpu.create(tile_w_nopad, tile_h_nopad, 1, in_out_tile_elemsize, 1, blob_vkallocator);
-                    }
-
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu[0];
-                    bindings[2] = in_tile_gpu[1];
-                    bindings[3] = in_tile_gpu[2];
-                    bindings[4] = in_tile_gpu[3];
-                    bindings[5] = in_tile_gpu[4];
-                    bindings[6] = in_tile_gpu[5];
-                    bindings[7] = in_tile_gpu[6];
-                    bindings[8] = in_tile_gpu[7];
-                    bindings[9] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu[0].w;
-                    constants[4].i = in_tile_gpu[0].h;
-                    constants[5].i = in_tile_gpu[0].cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu[0].w;
-                    dispatcher.h = in_tile_gpu[0].h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(realesrgan_preproc, bindings, constants, dispatcher);
-                }
+        return 0;
+    }
 
-                // realesrgan
-                ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
-                {
-                    ncnn::Extractor ex = net.create_extractor();
+    // keep up to tile_inflight tiles in flight, the slots stay with the
+    // context for the next call
+    const int inflight = std::max(std::min(tile_inflight, xtiles), 1);
+    while ((int)ctx.slots.size() < inflight)
+    {
+        ctx.slots.push_back(new TileSlot(net.vulkan_device()));
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        if (!ctx.upload_slots[k]) ctx.upload_slots[k] = new TileSlot(net.vulkan_device());
+        if (!ctx.download_slots[k]) ctx.download_slots[k] = new TileSlot(net.vulkan_device());
+    }
 
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+    // rows alternate between two sets of row buffers, while the tiles of one
+    // row run the next row is uploaded and the previous one downloaded
+    TileJob upload_jobs[2];
+    std::vector<TileJob> tile_jobs[2];
+    std::vector<TileJob> download_deps;
+    ncnn::Mat out_host[2];
 
-                    ex.input("data", in_tile_gpu[ti]);
+    int rows_reported = y0;
 
-                    ex.extract("output", out_tile_gpu[ti], cmd);
+    for (int r = -1; r <= ytiles; r++)
+    {
+        const int k = r & 1;
 
-                    {
-                        cmd.submit_and_wait();
-                        cmd.reset();
-                    }
-                }
+        const int ty0 = y0 + r * TILE_SIZE_Y;
+        const int ty1 = std::min(ty0 + TILE_SIZE_Y, y1);
 
-                ncnn::VkMat out_alpha_tile_gpu;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile_gpu = in_alpha_tile_gpu;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 4)
-                    {
-                        bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                }
+        // the output row reaches into the seams to the tile rows above and
+        // below, which hold this row's own pixels until the next row blends
+        // over them
+        const int feather_top = ty0 > y0 ? FEATHER : 0;
+        const int feather_bottom = ty1 < y1 ? FEATHER : 0;
+        const int out_y0 = ty0 * scale - feather_top;
 
-                // postproc
-                {
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = out_tile_gpu[0];
-                    bindings[1] = out_tile_gpu[1];
-                    bindings[2] = out_tile_gpu[2];
-                    bindings[3] = out_tile_gpu[3];
-                    bindings[4] = out_tile_gpu[4];
-                    bindings[5] = out_tile_gpu[5];
-                    bindings[6] = out_tile_gpu[6];
-                    bindings[7] = out_tile_gpu[7];
-                    bindings[8] = out_alpha_tile_gpu;
-                    bindings[9] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = out_tile_gpu[0].w;
-                    constants[1].i = out_tile_gpu[0].h;
-                    constants[2].i = out_tile_gpu[0].cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = prepadding * scale;
-                    constants[9].i = prepadding * scale;
-                    constants[10].i = channels;
-                    constants[11].i = out_alpha_tile_gpu.w;
-                    constants[12].i = out_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(realesrgan_postproc, bindings, constants, dispatcher);
-                }
-            }
-            else
+        // tiles, a feathered tile blends over the tile before it so those run
+        // one after another
+        if (r >= 0 && r < ytiles)
+        {
+            // the download of the row two above is done by now, but with
+            // feathering the tiles of the row above may still read the buffer,
+            // which must not go away under them when the geometry changes
+            const int out_gpu_h = (ty1 - ty0) * scale + feather_top + feather_bottom;
+            if (FEATHER && ctx.out_gpu[k].h != out_gpu_h)
             {
-                // preproc
-                ncnn::VkMat in_tile_gpu;
-                ncnn::VkMat in_alpha_tile_gpu;
+                for (size_t i = 0; i < tile_jobs[1 - k].size(); i++)
                 {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding;
-
-                    in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-
-                    if (channels == 4)
-                    {
-                        in_alpha_tile_gpu.create(tile_w_nopad, tile_h_nopad, 1, in_out_tile_elemsize, 1, blob_vkallocator);
-                    }
-
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu;
-                    bindings[2] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu.w;
-                    constants[4].i = in_tile_gpu.h;
-                    constants[5].i = in_tile_gpu.cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu.w;
-                    dispatcher.h = in_tile_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(realesrgan_preproc, bindings, constants, dispatcher);
+                    TileSlot::wait(tile_jobs[1 - k][i]);
                 }
+            }
 
-                // realesrgan
-                ncnn::VkMat out_tile_gpu;
-                {
-                    ncnn::Extractor ex = net.create_extractor();
+            create_out_gpu(ctx.out_gpu[k], w * scale, out_gpu_h, channels, opt);
 
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+            tile_jobs[k].clear();
 
-                    ex.input("data", in_tile_gpu);
+            for (int xi = 0; xi < xtiles; xi++)
+            {
+                TileSlot* slot = ctx.slots[xi % inflight];
 
-                    ex.extract("output", out_tile_gpu, cmd);
-                }
+                // wait for the tile previously recorded into this slot
+                slot->wait();
 
-                ncnn::VkMat out_alpha_tile_gpu;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile_gpu = in_alpha_tile_gpu;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 4)
-                    {
-                        bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                }
+                process_tile(ctx.in_gpu[k], ctx.out_gpu[k], ctx.out_gpu[1 - k], xi, ty0, ty1, w, channels, TILE_SIZE_X, xtiles, FEATHER, feather_top, slot->cmd, slot->option(opt));
 
-                // postproc
+                std::vector<TileJob> deps(1, upload_jobs[k]);
+                if (FEATHER && (r > 0 || xi > 0))
                 {
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = out_tile_gpu;
-                    bindings[1] = out_alpha_tile_gpu;
-                    bindings[2] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = out_tile_gpu.w;
-                    constants[1].i = out_tile_gpu.h;
-                    constants[2].i = out_tile_gpu.cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = prepadding * scale;
-                    constants[9].i = prepadding * scale;
-                    constants[10].i = channels;
-                    constants[11].i = out_alpha_tile_gpu.w;
-                    constants[12].i = out_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(realesrgan_postproc, bindings, constants, dispatcher);
+                    deps.push_back(xi > 0 ? tile_jobs[k].back() : tile_jobs[1 - k].back());
                 }
+
+                tile_jobs[k].push_back(slot->submit(deps));
+
+                // progress indicator
+                // fprintf(stderr, "%.2f%%\n", (float)(r * xtiles + xi) / (ytiles * xtiles) * 100);
             }
+        }
+
+        // upload the next row into the buffer the row before this one read
+        if (r + 1 < ytiles)
+        {
+            const int ny0 = ty0 + TILE_SIZE_Y;
+            const int ny1 = std::min(ny0 + TILE_SIZE_Y, y1);
 
-            if (xtiles > 1)
+            for (size_t i = 0; i < tile_jobs[1 - k].size(); i++)
             {
-                cmd.submit_and_wait();
-                cmd.reset();
+                TileSlot::wait(tile_jobs[1 - k][i]);
             }
 
-            // progress indicator
-            // fprintf(stderr, "%.2f%%\n", (float)(yi * xtiles + xi) / (ytiles * xtiles) * 100);
+            TileSlot* slot = ctx.upload_slots[1 - k];
+            slot->wait();
+
+            int in_tile_y0 = std::max(ny0 - prepadding, 0);
+            int in_tile_y1 = std::min(ny1 + prepadding, h);
+
+            // the band is uploaded as raw interleaved pixels on every path, the
+            // preproc shader unpacks and normalizes them, so the rows go
+            // straight from the decoded frame into the mapped staging buffer
+            ncnn::Mat in = ncnn::Mat(w, (in_tile_y1 - in_tile_y0), (unsigned char*)pixeldata + (size_t)in_tile_y0 * w * channels, (size_t)channels, 1);
+
+            slot->cmd.record_clone(in, ctx.in_gpu[1 - k], slot->option(opt));
+
+            upload_jobs[1 - k] = slot->submit();
         }
 
-        // download
+        // download once the tiles are done, after the row above, whose rows
+        // below the seam are overwritten by this one
+        if (r >= 0 && r < ytiles)
         {
-            ncnn::Mat out;
+            TileSlot* slot = ctx.download_slots[k];
+            slot->wait();
+
+            unsigned char* outdata = (unsigned char*)outimage.data + (size_t)out_y0 * w * scale * channels;
 
+            out_host[k].release();
             if (opt.use_fp16_storage && opt.use_int8_storage)
             {
-                out = ncnn::Mat(out_gpu.w, out_gpu.h, (unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, (size_t)channels, 1);
+                out_host[k] = ncnn::Mat(ctx.out_gpu[k].w, ctx.out_gpu[k].h, outdata, (size_t)channels, 1);
             }
 
-            cmd.record_clone(out_gpu, out, opt);
+            slot->cmd.record_clone(ctx.out_gpu[k], out_host[k], slot->option(opt));
+
+            download_deps.insert(download_deps.end(), tile_jobs[k].begin(), tile_jobs[k].end());
+            const TileJob download_job = slot->submit(download_deps);
+
+            download_deps.assign(1, download_job);
+        }
+
+        // the row above is final apart from the rows below its seam
+        if (r >= 1)
+        {
+            const int py0 = ty0 - TILE_SIZE_Y;
+            const int py1 = ty0;
+            const int pk = 1 - k;
+
+            ctx.download_slots[pk]->wait();
 
-            cmd.submit_and_wait();
+            const int prev_feather_top = py0 > y0 ? FEATHER : 0;
+            unsigned char* outdata = (unsigned char*)outimage.data + (size_t)(py0 * scale - prev_feather_top) * w * scale * channels;
 
-            if (!(opt.use_fp16_storage && opt.use_int8_storage))
+            to_pixels(out_host[pk], outdata, channels, opt);
+
+            const int rows_final = py1 >= y1 ? y1 : py1 - feather_in;
+            if (rows_done && rows_final > rows_reported)
             {
-                if (channels == 3)
-                {
+                rows_done(rows_reported, rows_final, userdata);
+            }
+            rows_reported = std::max(rows_reported, rows_final);
+        }
+    }
+
+    return 0;
+}
+
+// the host side of a download on devices without int8 storage, which hand back
+// float planes
+void RealESRGAN::to_pixels(const ncnn::Mat& out, unsigned char* outdata, int channels, const ncnn::Option& opt) const
+{
+    if (opt.use_fp16_storage && opt.use_int8_storage)
+        return;
+
+    if (channels == 3)
+    {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB2BGR);
+        out.to_pixels(outdata, ncnn::Mat::PIXEL_RGB2BGR);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB);
+        out.to_pixels(outdata, ncnn::Mat::PIXEL_RGB);
 #endif
-                }
-                if (channels == 4)
-                {
+    }
+    if (channels == 4)
+    {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA2BGRA);
+        out.to_pixels(outdata, ncnn::Mat::PIXEL_RGBA2BGRA);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA);
+        out.to_pixels(outdata, ncnn::Mat::PIXEL_RGBA);
 #endif
-                }
+    }
+}
+
+// recreating a row buffer is a no-op while the geometry repeats
+void RealESRGAN::create_out_gpu(ncnn::VkMat& out_gpu, int w, int h, int channels, const ncnn::Option& opt) const
+{
+    if (opt.use_fp16_storage && opt.use_int8_storage)
+    {
+        out_gpu.create(w, h, (size_t)channels, 1, opt.blob_vkallocator);
+    }
+    else
+    {
+        out_gpu.create(w, h, channels, (size_t)4u, 1, opt.blob_vkallocator);
+    }
+}
+
+void RealESRGAN::process_tile(const ncnn::VkMat& in_gpu, const ncnn::VkMat& out_gpu, const ncnn::VkMat& above_gpu, int xi, int y0, int y1, int w, int channels, int TILE_SIZE_X, int xtiles, int FEATHER, int feather_top, ncnn::VkCompute& cmd, const ncnn::Option& opt) const
+{
+    ncnn::VkAllocator* blob_vkallocator = opt.blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator = opt.staging_vkallocator;
+
+    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+
+    const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+    const int tile_h_nopad = y1 - y0;
+
+    // the tile reaches feather output pixels into the seams to its neighbours
+    const int feather_left = xi > 0 ? FEATHER : 0;
+    const int feather_right = xi + 1 < xtiles ? FEATHER : 0;
+
+    if (tta_mode)
+    {
+        // preproc
+        ncnn::VkMat in_tile_gpu[8];
+        ncnn::VkMat in_alpha_tile_gpu;
+        {
+            // crop tile
+            int tile_x0 = xi * TILE_SIZE_X - prepadding;
+            int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding;
+            int tile_y0 = y0 - prepadding;
+            int tile_y1 = y1 + prepadding;
+
+            in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+
+            if (channels == 4)
+            {
+                in_alpha_tile_gpu.create(tile_w_nopad, tile_h_nopad, 1, in_out_tile_elemsize, 1, blob_vkallocator);
             }
+
+            std::vector<ncnn::VkMat> bindings(10);
+            bindings[0] = in_gpu;
+            bindings[1] = in_tile_gpu[0];
+            bindings[2] = in_tile_gpu[1];
+            bindings[3] = in_tile_gpu[2];
+            bindings[4] = in_tile_gpu[3];
+            bindings[5] = in_tile_gpu[4];
+            bindings[6] = in_tile_gpu[5];
+            bindings[7] = in_tile_gpu[6];
+            bindings[8] = in_tile_gpu[7];
+            bindings[9] = in_alpha_tile_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(13);
+            constants[0].i = in_gpu.w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = in_tile_gpu[0].w;
+            constants[4].i = in_tile_gpu[0].h;
+            constants[5].i = in_tile_gpu[0].cstep;
+            constants[6].i = prepadding;
+            constants[7].i = prepadding;
+            constants[8].i = xi * TILE_SIZE_X;
+            constants[9].i = std::min(y0, prepadding);
+            constants[10].i = channels;
+            constants[11].i = in_alpha_tile_gpu.w;
+            constants[12].i = in_alpha_tile_gpu.h;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = in_tile_gpu[0].w;
+            dispatcher.h = in_tile_gpu[0].h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(realesrgan_preproc, bindings, constants, dispatcher);
+        }
+
+        // realesrgan
+        // all eight variants are recorded back to back and go to the device
+        // with the postproc in a single submit
+        ncnn::VkMat out_tile_gpu[8];
+        for (int ti = 0; ti < 8; ti++)
+        {
+            ncnn::Extractor ex = net.create_extractor();
+
+            ex.set_blob_vkallocator(blob_vkallocator);
+            ex.set_workspace_vkallocator(blob_vkallocator);
+            ex.set_staging_vkallocator(staging_vkallocator);
+
+            ex.input("data", in_tile_gpu[ti]);
+
+            ex.extract("output", out_tile_gpu[ti], cmd);
+
+            // the variant input is consumed, let the next extraction reuse it
+            in_tile_gpu[ti].release();
+        }
+
+        ncnn::VkMat out_alpha_tile_gpu;
+        if (channels == 4)
+        {
+            if (scale == 1)
+            {
+                out_alpha_tile_gpu = in_alpha_tile_gpu;
+            }
+            if (scale == 2)
+            {
+                bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+            }
+            if (scale == 3)
+            {
+                bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+            }
+            if (scale == 4)
+            {
+                bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+            }
+        }
+
+        // postproc
+        {
+            std::vector<ncnn::VkMat> bindings(11);
+            bindings[0] = out_tile_gpu[0];
+            bindings[1] = out_tile_gpu[1];
+            bindings[2] = out_tile_gpu[2];
+            bindings[3] = out_tile_gpu[3];
+            bindings[4] = out_tile_gpu[4];
+            bindings[5] = out_tile_gpu[5];
+            bindings[6] = out_tile_gpu[6];
+            bindings[7] = out_tile_gpu[7];
+            bindings[8] = out_alpha_tile_gpu;
+            bindings[9] = out_gpu;
+            bindings[10] = above_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(17);
+            constants[0].i = out_tile_gpu[0].w;
+            constants[1].i = out_tile_gpu[0].h;
+            constants[2].i = out_tile_gpu[0].cstep;
+            constants[3].i = out_gpu.w;
+            constants[4].i = out_gpu.h;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = xi * TILE_SIZE_X * scale - feather_left;
+            constants[7].i = tile_w_nopad * scale + feather_left + feather_right;
+            constants[8].i = prepadding * scale - feather_left;
+            constants[9].i = prepadding * scale - feather_top;
+            constants[10].i = channels;
+            constants[11].i = out_alpha_tile_gpu.w;
+            constants[12].i = out_alpha_tile_gpu.h;
+            constants[13].i = feather_left * 2;
+            constants[14].i = feather_top * 2;
+            constants[15].i = above_gpu.h - feather_top * 2;
+            constants[16].i = above_gpu.cstep;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = tile_w_nopad * scale + feather_left + feather_right;
+            dispatcher.h = out_gpu.h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(realesrgan_postproc, bindings, constants, dispatcher);
         }
     }
+    else
+    {
+        // preproc
+        ncnn::VkMat in_tile_gpu;
+        ncnn::VkMat in_alpha_tile_gpu;
+        {
+            // crop tile
+            int tile_x0 = xi * TILE_SIZE_X - prepadding;
+            int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding;
+            int tile_y0 = y0 - prepadding;
+            int tile_y1 = y1 + prepadding;
 
-    net.vulkan_device()->reclaim_blob_allocator(blob_vkallocator);
-    net.vulkan_device()->reclaim_staging_allocator(staging_vkallocator);
+            in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
 
-    return 0;
+            if (channels == 4)
+            {
+                in_alpha_tile_gpu.create(tile_w_nopad, tile_h_nopad, 1, in_out_tile_elemsize, 1, blob_vkallocator);
+            }
+
+            std::vector<ncnn::VkMat> bindings(3);
+            bindings[0] = in_gpu;
+            bindings[1] = in_tile_gpu;
+            bindings[2] = in_alpha_tile_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(13);
+            constants[0].i = in_gpu.w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = in_tile_gpu.w;
+            constants[4].i = in_tile_gpu.h;
+            constants[5].i = in_tile_gpu.cstep;
+            constants[6].i = prepadding;
+            constants[7].i = prepadding;
+            constants[8].i = xi * TILE_SIZE_X;
+            constants[9].i = std::min(y0, prepadding);
+            constants[10].i = channels;
+            constants[11].i = in_alpha_tile_gpu.w;
+            constants[12].i = in_alpha_tile_gpu.h;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = in_tile_gpu.w;
+            dispatcher.h = in_tile_gpu.h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(realesrgan_preproc, bindings, constants, dispatcher);
+        }
+
+        // realesrgan
+        ncnn::VkMat out_tile_gpu;
+        {
+            ncnn::Extractor ex = net.create_extractor();
+
+            ex.set_blob_vkallocator(blob_vkallocator);
+            ex.set_workspace_vkallocator(blob_vkallocator);
+            ex.set_staging_vkallocator(staging_vkallocator);
+
+            ex.input("data", in_tile_gpu);
+
+            ex.extract("output", out_tile_gpu, cmd);
+        }
+
+        ncnn::VkMat out_alpha_tile_gpu;
+        if (channels == 4)
+        {
+            if (scale == 1)
+            {
+                out_alpha_tile_gpu = in_alpha_tile_gpu;
+            }
+            if (scale == 2)
+            {
+                bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+            }
+            if (scale == 3)
+            {
+                bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+            }
+            if (scale == 4)
+            {
+                bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+            }
+        }
+
+        // postproc
+        {
+            std::vector<ncnn::VkMat> bindings(4);
+            bindings[0] = out_tile_gpu;
+            bindings[1] = out_alpha_tile_gpu;
+            bindings[2] = out_gpu;
+            bindings[3] = above_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(17);
+            constants[0].i = out_tile_gpu.w;
+            constants[1].i = out_tile_gpu.h;
+            constants[2].i = out_tile_gpu.cstep;
+            constants[3].i = out_gpu.w;
+            constants[4].i = out_gpu.h;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = xi * TILE_SIZE_X * scale - feather_left;
+            constants[7].i = tile_w_nopad * scale + feather_left + feather_right;
+            constants[8].i = prepadding * scale - feather_left;
+            constants[9].i = prepadding * scale - feather_top;
+            constants[10].i = channels;
+            constants[11].i = out_alpha_tile_gpu.w;
+            constants[12].i = out_alpha_tile_gpu.h;
+            constants[13].i = feather_left * 2;
+            constants[14].i = feather_top * 2;
+            constants[15].i = above_gpu.h - feather_top * 2;
+            constants[16].i = above_gpu.cstep;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = tile_w_nopad * scale + feather_left + feather_right;
+            dispatcher.h = out_gpu.h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(realesrgan_postproc, bindings, constants, dispatcher);
+        }
+    }
 }
@@ -4,12 +4,70 @@
 #define REALESRGAN_H
 
 #include <string>
+#include <vector>
 
 // ncnn
 #include "net.h"
 #include "gpu.h"
 #include "layer.h"
 
+class RealESRGAN;
+class TileSlot;
+
+// model files read once and shared by the instances of every gpu, the weights
+// are mapped from disk so all devices upload from the same pages
+// the model must outlive the instances loaded from it
+class RealESRGANModel
+{
+public:
+    RealESRGANModel();
+    ~RealESRGANModel();
+
+#if _WIN32
+    int load(const std::wstring& parampath, const std::wstring& modelpath);
+#else
+    int load(const std::string& parampath, const std::string& modelpath);
+#endif
+
+private:
+    friend class RealESRGAN;
+
+    std::string param;
+    void* weights;
+    size_t weights_size;
+#if _WIN32
+    void* mapping;
+#endif
+};
+
+// state one thread keeps across process() calls, the allocators, command
+// buffers and row buffers on the device are set up once and reused by every
+// frame of the same size
+// a context belongs to one instance and is used by one thread at a time
+class RealESRGANContext
+{
+public:
+    RealESRGANContext(const RealESRGAN& realesrgan);
+    ~RealESRGANContext();
+
+private:
+    friend class RealESRGAN;
+
+    const ncnn::VulkanDevice* vkdev;
+    ncnn::VkAllocator* blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator;
+    ncnn::VkCompute* cmd;
+    std::vector<TileSlot*> slots;
+
+    // row uploads and downloads, by row parity
+    TileSlot* upload_slots[2];
+    TileSlot* download_slots[2];
+    ncnn::VkMat in_gpu[2];
+
+    // feathered tiles blend over the output row above
+    ncnn::VkMat out_gpu[2];
+};
+
 class RealESRGAN
 {
 public:
@@ -22,14 +80,41 @@ public:
     int load(const std::string& parampath, const std::string& modelpath);
 #endif
 
+    int load(const RealESRGANModel& model);
+
     int process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const;
 
+    // called whenever the output of input rows [y0, y1) has landed in outimage
+    typedef void (*rows_done_callback)(int y0, int y1, void* userdata);
+
+    // only input rows [y0, y1) are upscaled into the matching rows of outimage,
+    // disjoint bands of one image may run on different instances concurrently
+    int process(const ncnn::Mat& inimage, ncnn::Mat& outimage, int y0, int y1, RealESRGANContext& ctx, rows_done_callback rows_done = 0, void* userdata = 0) const;
+
 public:
     // realesrgan parameters
     int scale;
     int tilesize;
     int prepadding;
 
+    // number of tiles of one row kept in flight on the device
+    int tile_inflight;
+
+    // input pixels on either side of a tile seam blended between the two
+    // tiles, at most prepadding
+    int feather;
+
+private:
+    friend class RealESRGANContext;
+
+    int create_pipelines();
+
+    void create_out_gpu(ncnn::VkMat& out_gpu, int w, int h, int channels, const ncnn::Option& opt) const;
+
+    void to_pixels(const ncnn::Mat& out, unsigned char* outdata, int channels, const ncnn::Option& opt) const;
+
+    void process_tile(const ncnn::VkMat& in_gpu, const ncnn::VkMat& out_gpu, const ncnn::VkMat& above_gpu, int xi, int y0, int y1, int w, int channels, int TILE_SIZE_X, int xtiles, int FEATHER, int feather_top, ncnn::VkCompute& cmd, const ncnn::Option& opt) const;
+
 private:
     ncnn::Net net;
     ncnn::Pipeline* realesrgan_preproc;
@@ -38,6 +123,9 @@ private:
     ncnn::Layer* bicubic_3x;
     ncnn::Layer* bicubic_4x;
     bool tta_mode;
+
+    // set when loaded by path
+    RealESRGANModel* model;
 };
 
 #endif // REALESRGAN_H
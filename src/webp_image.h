@@ -7,50 +7,179 @@
 #include "webp/decode.h"
 #include "webp/encode.h"
 
-unsigned char* webp_load(const unsigned char* buffer, int len, int* w, int* h, int* c)
+// returns the memory a w x h x c webp is decoded into, 0 to give up
+typedef unsigned char* (*webp_alloc_callback)(int w, int h, int c, void* userdata);
+
+// points the decoder output at memory from alloc, sized by the features
+static int webp_set_output(WebPDecoderConfig* config, webp_alloc_callback alloc, void* userdata)
 {
-    unsigned char* pixeldata = 0;
+    int width = config->input.width;
+    int height = config->input.height;
+    int channels = config->input.has_alpha ? 4 : 3;
+
+    unsigned char* pixeldata = alloc(width, height, channels, userdata);
+    if (!pixeldata)
+        return 0;
+
+#if _WIN32
+    config->output.colorspace = channels == 4 ? MODE_BGRA : MODE_BGR;
+#else
+    config->output.colorspace = channels == 4 ? MODE_RGBA : MODE_RGB;
+#endif
+
+    config->output.u.RGBA.stride = width * channels;
+    config->output.u.RGBA.size = (size_t)width * height * channels;
+    config->output.u.RGBA.rgba = pixeldata;
+    config->output.is_external_memory = 1;
 
+    return 1;
+}
+
+// decodes a webp in memory, 1 on success, 0 if it is no webp and -1 if it is
+// a broken one, memory from alloc stays with the caller either way
+int webp_load(const unsigned char* buffer, size_t len, webp_alloc_callback alloc, void* userdata)
+{
     WebPDecoderConfig config;
     WebPInitDecoderConfig(&config);
 
     if (WebPGetFeatures(buffer, len, &config.input) != VP8_STATUS_OK)
+        return 0;
+
+    if (!webp_set_output(&config, alloc, userdata))
+        return -1;
+
+    if (WebPDecode(buffer, len, &config) != VP8_STATUS_OK)
+        return -1;
+
+    return 1;
+}
+
+// reads a webp file in chunks and decodes every chunk as soon as it is read,
+// results as for webp_load, fp is rewound when it holds no webp
+int webp_load_file(FILE* fp, webp_alloc_callback alloc, void* userdata)
+{
+    const size_t chunk = 65536;
+
+    unsigned char* buffer = (unsigned char*)malloc(chunk);
+    if (!buffer)
+        return 0;
+
+    size_t len = fread(buffer, 1, chunk, fp);
+
+    int ret = 0;
+
+    WebPDecoderConfig config;
+    WebPInitDecoderConfig(&config);
+
+    // the features are all in the first few dozen bytes
+    if (WebPGetFeatures(buffer, len, &config.input) != VP8_STATUS_OK)
+    {
+        rewind(fp);
+    }
+    else if (!webp_set_output(&config, alloc, userdata))
+    {
+        ret = -1;
+    }
+    else
+    {
+        WebPIDecoder* idec = WebPIDecode(NULL, 0, &config);
+
+        VP8StatusCode status = idec ? WebPIAppend(idec, buffer, len) : VP8_STATUS_OUT_OF_MEMORY;
+        while (status == VP8_STATUS_SUSPENDED)
+        {
+            len = fread(buffer, 1, chunk, fp);
+            if (len == 0)
+                break;
+
+            status = WebPIAppend(idec, buffer, len);
+        }
+
+        if (idec)
+            WebPIDelete(idec);
+
+        ret = status == VP8_STATUS_OK ? 1 : -1;
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+// encodes to memory released with WebPFree, quality 0-100 is lossy and below 0
+// selects lossless, near_lossless 0-99 lets lossless quantize for a smaller
+// file and 100 leaves it off, method 0-6 trades speed for size
+unsigned char* webp_save_to_mem(const unsigned char* pixeldata, int w, int h, int c, size_t* length, float quality = -1, int method = 4, int near_lossless = 100)
+{
+    if (c != 3 && c != 4)
         return NULL;
 
-    int width = config.input.width;
-    int height = config.input.height;
-    int channels = config.input.has_alpha ? 4 : 3;
+    WebPConfig config;
+    if (!WebPConfigInit(&config))
+        return NULL;
 
-    pixeldata = (unsigned char*)malloc(width * height * channels);
+    if (quality < 0)
+    {
+        // the effort WebPEncodeLossless* uses
+        config.lossless = 1;
+        config.quality = 70;
+        config.near_lossless = near_lossless;
+    }
+    else
+    {
+        config.quality = quality;
+    }
+    config.method = method;
+    config.thread_level = 1;
 
+    if (!WebPValidateConfig(&config))
+        return NULL;
+
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture))
+        return NULL;
+
+    // lossless encodes argb directly, lossy converts to yuv on import
+    picture.use_argb = config.lossless;
+    picture.width = w;
+    picture.height = h;
+
+    int ok;
 #if _WIN32
-    config.output.colorspace = channels == 4 ? MODE_BGRA : MODE_BGR;
+    if (c == 3)
+        ok = WebPPictureImportBGR(&picture, pixeldata, w * 3);
+    else
+        ok = WebPPictureImportBGRA(&picture, pixeldata, w * 4);
 #else
-    config.output.colorspace = channels == 4 ? MODE_RGBA : MODE_RGB;
+    if (c == 3)
+        ok = WebPPictureImportRGB(&picture, pixeldata, w * 3);
+    else
+        ok = WebPPictureImportRGBA(&picture, pixeldata, w * 4);
 #endif
 
-    config.output.u.RGBA.stride = width * channels;
-    config.output.u.RGBA.size = width * height * channels;
-    config.output.u.RGBA.rgba = pixeldata;
-    config.output.is_external_memory = 1;
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    picture.writer = WebPMemoryWrite;
+    picture.custom_ptr = &writer;
 
-    if (WebPDecode(buffer, len, &config) != VP8_STATUS_OK)
+    ok = ok && WebPEncode(&config, &picture);
+
+    WebPPictureFree(&picture);
+
+    if (!ok)
     {
-        free(pixeldata);
+        WebPMemoryWriterClear(&writer);
         return NULL;
     }
 
-    *w = width;
-    *h = height;
-    *c = channels;
+    *length = writer.size;
 
-    return pixeldata;
+    return writer.mem;
 }
 
 #if _WIN32
-int webp_save(const wchar_t* filepath, int w, int h, int c, const unsigned char* pixeldata)
+int webp_save(const wchar_t* filepath, int w, int h, int c, const unsigned char* pixeldata, float quality = -1, int method = 4, int near_lossless = 100)
 #else
-int webp_save(const char* filepath, int w, int h, int c, const unsigned char* pixeldata)
+int webp_save(const char* filepath, int w, int h, int c, const unsigned char* pixeldata, float quality = -1, int method = 4, int near_lossless = 100)
 #endif
 {
     int ret = 0;
@@ -60,28 +189,8 @@ int webp_save(const char* filepath, int w, int h, int c, const unsigned char* pi
 
     FILE* fp = 0;
 
-    if (c == 3)
-    {
-#if _WIN32
-        length = WebPEncodeLosslessBGR(pixeldata, w, h, w * 3, &output);
-#else
-        length = WebPEncodeLosslessRGB(pixeldata, w, h, w * 3, &output);
-#endif
-    }
-    else if (c == 4)
-    {
-#if _WIN32
-        length = WebPEncodeLosslessBGRA(pixeldata, w, h, w * 4, &output);
-#else
-        length = WebPEncodeLosslessRGBA(pixeldata, w, h, w * 4, &output);
-#endif
-    }
-    else
-    {
-        // unsupported channel type
-    }
-
-    if (length == 0)
+    output = webp_save_to_mem(pixeldata, w, h, c, &length, quality, method, near_lossless);
+    if (!output)
         goto RETURN;
 
 #if _WIN32
@@ -92,13 +201,11 @@ int webp_save(const char* filepath, int w, int h, int c, const unsigned char* pi
     if (!fp)
         goto RETURN;
 
-    fwrite(output, 1, length, fp);
-
-    ret = 1;
+    ret = fwrite(output, 1, length, fp) == length;
 
 RETURN:
     if (output) WebPFree(output);
-    if (fp) fclose(fp);
+    if (fp) ret = fclose(fp) == 0 && ret;
 
     return ret;
 }